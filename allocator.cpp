@@ -1,15 +1,118 @@
 ﻿#include "allocator.h"
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Номер младшего единичного бита ненулевого числа
+static size_t lowestBit(unsigned long long mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return index;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+// Номер старшего единичного бита ненулевого числа
+static size_t highestBit(unsigned long long mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, mask);
+	return index;
+#else
+	return 63 - __builtin_clzll(mask);
+#endif
+}
+
+// Добавляет время жизни объекта в гистограмму, если она задана
+class LatencyTimer
+{
+private:
+	unsigned long long* histogram_;
+	std::chrono::steady_clock::time_point start_;
+public:
+	LatencyTimer(unsigned long long* histogram) : histogram_(histogram)
+	{
+		if (histogram_)
+		{
+			start_ = std::chrono::steady_clock::now();
+		}
+	}
+	~LatencyTimer()
+	{
+		if (histogram_)
+		{
+			unsigned long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+			++histogram_[ns ? highestBit(ns) : 0];
+		}
+	}
+};
 
 Allocator::Allocator(void* mem, size_t totalBytes)
 {
 	memByte_ = static_cast<unsigned char*>(mem);
 	memLong_ = static_cast<size_t*>(mem);
 	sizeByte_ = totalBytes;
-	if (sizeByte_ < 33)
+	if (sizeByte_ < (2 + minNodeLongCount_) * 8)
 	{
 		throw std::exception("Too little amount of memory");
 	}
+	endLong_ = sizeByte_ / 8;
+	debugMode_ = false;
+	monotonic_ = false;
+	poolCount_ = 0;
+	latencyTracking_ = false;
+	stats_ = AllocatorStats();
+	reset();
+}
+
+void Allocator::reset()
+{
+	for (size_t i = 0; i < binCount_; ++i)
+	{
+		bins_[i] = nullptr;
+		binCounts_[i] = 0;
+	}
+	stats_.bytesInUse_ = 0;
+	stats_.freeBytes_ = 0;
+	for (size_t i = 0; i < (binCount_ + 63) / 64; ++i)
+	{
+		binMask_[i] = 0;
+	}
+	for (size_t i = 0; i < poolCount_; ++i) // Плиты пулов освобождаются вместе со всей областью, регистрация пулов сохраняется
+	{
+		pools_[i].slabs_ = nullptr;
+		pools_[i].head_.store(0);
+	}
 	memLong_[0] = 0;
+	memLong_[1] = reinterpret_cast<size_t>(memLong_ + 2);
+	memLong_[2] = 0; // Вся область после заголовка - один свободный участок
+	if (monotonic_)
+	{
+		memLong_[3] = freeTag_;
+		bump_ = memLong_ + 2;
+	}
+	else
+	{
+		insertFree_(memLong_ + 2);
+	}
+}
+
+void Allocator::setMonotonicMode(bool enabled)
+{
+	if (memLong_[0])
+	{
+		throw std::exception("Monotonic mode can be switched only in empty memory area");
+	}
+	monotonic_ = enabled;
+	reset();
 }
 
 size_t Allocator::getLongCount_(size_t bytesCount)
@@ -17,114 +120,696 @@ size_t Allocator::getLongCount_(size_t bytesCount)
 	return bytesCount / 8 + bool(bytesCount % 8);
 }
 
-size_t* Allocator::findFree_(size_t bytesCount, size_t*& prev, size_t*& next) const
+size_t* Allocator::nodeEnd_(const size_t* node) const
 {
-	if (!memLong_[0]) // Первый участок
+	return node[0] ? reinterpret_cast<size_t*>(node[0]) : memLong_ + endLong_;
+}
+
+bool Allocator::isFree_(const size_t* node)
+{
+	return node[1] == freeTag_;
+}
+
+size_t Allocator::canary_(const size_t* node)
+{
+	return (usedMagic_ ^ ((reinterpret_cast<size_t>(node) >> 3) & 0xFFFF)) << 48;
+}
+
+size_t Allocator::blockBytes_(const size_t* node)
+{
+	return node[1] & sizeMask_;
+}
+
+bool Allocator::isUsedBlock_(const size_t* node) const
+{
+	if (reinterpret_cast<size_t>(node) % 8 || node < memLong_ + 2 || node + minNodeLongCount_ > memLong_ + endLong_)
 	{
-		if (bytesCount > sizeByte_ - 32)
-		{
-			return nullptr;
-		}
-		prev = memLong_ + 1;
-		next = nullptr;
-		return memLong_ + 2;
+		return false;
+	}
+	if (isFree_(node)) // Метка свободного блока может совпасть с канарейкой
+	{
+		return false;
+	}
+	if ((node[1] & ~(sizeMask_ | prevFreeFlag_ | alignMask_)) != canary_(node))
+	{
+		return false;
+	}
+	const size_t* next = reinterpret_cast<const size_t*>(node[0]);
+	return !next || (next > node && next < memLong_ + endLong_ && !(reinterpret_cast<size_t>(next) % 8));
+}
+
+bool Allocator::containsBlock_(const size_t* node) const
+{
+	const size_t* cur = reinterpret_cast<const size_t*>(memLong_[1]);
+	while (cur && cur < node)
+	{
+		cur = reinterpret_cast<const size_t*>(*cur);
 	}
-	size_t* left = memLong_ + 1, *right = reinterpret_cast<size_t*>(*left);
-	if ((right - left) * 8 >= bytesCount + 24) // Проверка участка между заголовком области и крайним левым участком
+	return cur == node;
+}
+
+AllocatorStats Allocator::stats() const
+{
+	AllocatorStats result = stats_;
+	result.blockCount_ = memLong_[0];
+	result.headerBytes_ = memLong_[0] * 16;
+	result.freeBlockCount_ = 0;
+	result.largestFreeBlock_ = 0;
+	for (size_t i = 0; i < AllocatorStats::histogramSize; ++i)
 	{
-		prev = left;
-		next = right;
-		return left + 1;
+		result.freeHistogram_[i] = 0;
 	}
-	for (size_t i = 0; i < memLong_[0]; ++i) // Проверка между каджыми двумя участками
+	for (size_t bin = 0; bin < binCount_; ++bin)
 	{
-		left = right;
-		right = reinterpret_cast<size_t*>(*left);
-		size_t leftLongCount = getLongCount_(*(left + 1));
-		if (right) // Если участок не крайний правый
+		if (!binCounts_[bin])
 		{
-			if (right - left - 2 - leftLongCount >= getLongCount_(bytesCount) + 2)
-			{
-				prev = left;
-				next = right;
-				return left + 2 + leftLongCount;
-			}
+			continue;
 		}
-		else // Если участок крайний правый
+		// Все участки корзины лежат в пределах одной степени двойки, поэтому корзина целиком попадает в одну ячейку гистограммы
+		result.freeHistogram_[highestBit((nodeEnd_(bins_[bin]) - bins_[bin]) * 8)] += binCounts_[bin];
+		result.freeBlockCount_ += binCounts_[bin];
+	}
+	for (size_t bin = binCount_; bin--;) // Наибольший участок лежит в старшей непустой корзине
+	{
+		if (binCounts_[bin])
 		{
-			if ((sizeByte_ % 8) && !(sizeByte_ / 8 - (left + 2 - memLong_ + (*(left + 1) / 8)))) // Если справа остается участок меньше восьми байтов 
+			for (size_t* node = bins_[bin]; node; node = reinterpret_cast<size_t*>(node[3]))
 			{
-				return nullptr;
-			}
-			if (sizeByte_ - (left + 2 + getLongCount_(*(left + 1)) - memLong_) * 8 >= bytesCount + 16)
-			{
-				prev = left;
-				next = nullptr;
-				return left + 2 + leftLongCount;
+				size_t bytes = (nodeEnd_(node) - node) * 8;
+				result.largestFreeBlock_ = bytes > result.largestFreeBlock_ ? bytes : result.largestFreeBlock_;
 			}
+			break;
+		}
+	}
+	if (monotonic_ && bump_) // Остаток области в монотонном режиме не входит в корзины
+	{
+		size_t bytes = (memLong_ + endLong_ - bump_) * 8;
+		++result.freeHistogram_[highestBit(bytes)];
+		++result.freeBlockCount_;
+		result.freeBytes_ += bytes;
+		result.largestFreeBlock_ = bytes > result.largestFreeBlock_ ? bytes : result.largestFreeBlock_;
+	}
+	return result;
+}
+
+void Allocator::setLatencyTracking(bool enabled)
+{
+	latencyTracking_ = enabled;
+}
+
+size_t Allocator::blockCount() const
+{
+	return memLong_[0];
+}
+
+void Allocator::setDebugMode(bool enabled)
+{
+	debugMode_ = enabled;
+}
+
+size_t Allocator::binIndex_(size_t longCount)
+{
+	if (longCount < smallBinCount_)
+	{
+		return longCount;
+	}
+	size_t log = highestBit(longCount);
+	// Два бита после старшего определяют часть диапазона [2^log, 2^(log+1)), в которую попадает длина
+	return smallBinCount_ + (log - smallBinLog_) * binsPerPowerOfTwo_ + ((longCount >> (log - 2)) & (binsPerPowerOfTwo_ - 1));
+}
+
+void Allocator::insertFree_(size_t* node)
+{
+	size_t* end = nodeEnd_(node);
+	size_t bin = binIndex_(end - node);
+	node[1] = freeTag_;
+	*(end - 1) = reinterpret_cast<size_t>(node);
+	if (node[0]) // Правый сосед свободного участка всегда занят
+	{
+		end[1] |= prevFreeFlag_;
+	}
+	node[2] = 0;
+	node[3] = reinterpret_cast<size_t>(bins_[bin]);
+	if (bins_[bin])
+	{
+		bins_[bin][2] = reinterpret_cast<size_t>(node);
+	}
+	bins_[bin] = node;
+	binMask_[bin / 64] |= 1ull << (bin % 64);
+	++binCounts_[bin];
+	stats_.freeBytes_ += (end - node) * 8;
+}
+
+void Allocator::removeFree_(size_t* node)
+{
+	size_t longCount = nodeEnd_(node) - node;
+	size_t bin = binIndex_(longCount);
+	--binCounts_[bin];
+	stats_.freeBytes_ -= longCount * 8;
+	size_t* prevFree = reinterpret_cast<size_t*>(node[2]);
+	size_t* nextFree = reinterpret_cast<size_t*>(node[3]);
+	if (prevFree)
+	{
+		prevFree[3] = node[3];
+	}
+	else
+	{
+		bins_[bin] = nextFree;
+	}
+	if (nextFree)
+	{
+		nextFree[2] = node[2];
+	}
+	if (!bins_[bin])
+	{
+		binMask_[bin / 64] &= ~(1ull << (bin % 64));
+	}
+}
+
+size_t* Allocator::findFree_(size_t longCount) const
+{
+	size_t bin = binIndex_(longCount);
+	// В корзине, соответствующей запрошенной длине, могут лежать участки короче запрошенного, поэтому она проверяется поэлементно
+	for (size_t* node = bins_[bin]; node; node = reinterpret_cast<size_t*>(node[3]))
+	{
+		if (size_t(nodeEnd_(node) - node) >= longCount)
+		{
+			return node;
+		}
+	}
+	// Любой участок из следующих непустых корзин гарантированно подходит
+	++bin;
+	for (size_t word = bin / 64; word < (binCount_ + 63) / 64; ++word)
+	{
+		unsigned long long mask = binMask_[word];
+		if (word == bin / 64)
+		{
+			mask &= ~0ull << (bin % 64);
+		}
+		if (mask)
+		{
+			return bins_[word * 64 + lowestBit(mask)];
 		}
 	}
 	return nullptr;
 }
 
-void* Allocator::allocate(size_t numBytes)
+size_t Allocator::getBlockLongCount_(size_t numBytes) const
 {
-	if (!numBytes)
+	if (!numBytes || numBytes > sizeByte_ || numBytes > sizeMask_)
 	{
 		throw std::bad_alloc();
 	}
-	size_t* cur, *left, *right;
-	if (!(cur = findFree_(numBytes, left, right)))
+	size_t longCount = getLongCount_(numBytes) + 2;
+	return longCount < minNodeLongCount_ ? minNodeLongCount_ : longCount;
+}
+
+void* Allocator::occupy_(size_t* cur, size_t longCount, size_t numBytes, bool prevFree)
+{
+	if (size_t(nodeEnd_(cur) - cur) >= longCount + minNodeLongCount_) // Остаток участка достаточно велик, чтобы остаться свободным участком
 	{
-		throw std::bad_alloc();
+		size_t* rest = cur + longCount;
+		rest[0] = cur[0];
+		cur[0] = reinterpret_cast<size_t>(rest);
+		insertFree_(rest);
+	}
+	else if (cur[0]) // Участок занят целиком, у правого соседа больше нет свободного левого соседа
+	{
+		reinterpret_cast<size_t*>(cur[0])[1] &= ~prevFreeFlag_;
 	}
-	*left = reinterpret_cast<size_t>(cur); // Изменение значения адреса следующего участка у левого соседа
-	*cur = reinterpret_cast<size_t>(right); // Установка значения адреса следующего участка у текущего участка адреса правого участка
-	*(cur + 1) = numBytes; // Установка значения размера участка текущему участку
+	*(cur + 1) = canary_(cur) | numBytes | (prevFree ? prevFreeFlag_ : 0); // Установка метки и размера участка текущему участку
 	++memLong_[0];
+	++stats_.allocateCount_;
+	stats_.bytesInUse_ += numBytes;
 	return cur + 2; // Возвращается указатель на начало пользовательских данных
 }
 
+size_t* Allocator::alignedHeader_(size_t* cur, size_t alignment) const
+{
+	size_t* block = reinterpret_cast<size_t*>((reinterpret_cast<size_t>(cur + 2) + alignment - 1) & ~(alignment - 1)) - 2;
+	while (block != cur && size_t(block - cur) < minNodeLongCount_)
+	{
+		block += alignment / 8;
+	}
+	return block;
+}
+
+void* Allocator::bumpAllocate_(size_t numBytes, size_t alignment)
+{
+	size_t longCount = getBlockLongCount_(numBytes);
+	size_t* cur = bump_;
+	size_t* block = cur && alignment / 8 <= endLong_ ? (alignment > 8 ? alignedHeader_(cur, alignment) : cur) : nullptr;
+	if (!block || block >= memLong_ + endLong_ || size_t(memLong_ + endLong_ - block) < longCount)
+	{
+		++stats_.failedAllocateCount_;
+		return nullptr;
+	}
+	if (block != cur) // Отступ перед выровненным участком остается свободным участком
+	{
+		cur[0] = reinterpret_cast<size_t>(block);
+	}
+	size_t* rest = block + longCount;
+	if (size_t(memLong_ + endLong_ - rest) >= minNodeLongCount_)
+	{
+		rest[0] = 0;
+		rest[1] = freeTag_;
+		block[0] = reinterpret_cast<size_t>(rest);
+		bump_ = rest;
+	}
+	else
+	{
+		block[0] = 0;
+		bump_ = nullptr;
+	}
+	block[1] = canary_(block) | numBytes | alignmentBits_(alignment) | (block != cur ? prevFreeFlag_ : 0);
+	++memLong_[0];
+	++stats_.allocateCount_;
+	stats_.bytesInUse_ += numBytes;
+	return block + 2;
+}
+
+void* Allocator::allocate(size_t numBytes)
+{
+	return allocate(numBytes, 8);
+}
+
+void* Allocator::allocate(size_t numBytes, size_t alignment)
+{
+	void* result = tryAllocate(numBytes, alignment);
+	if (!result)
+	{
+		throw std::bad_alloc();
+	}
+	return result;
+}
+
+void* Allocator::tryAllocate(size_t numBytes, size_t alignment)
+{
+	if (!alignment || (alignment & (alignment - 1)))
+	{
+		throw std::exception("Alignment must be a power of two");
+	}
+	if (!numBytes || numBytes > sizeByte_ || numBytes > sizeMask_)
+	{
+		return nullptr;
+	}
+	LatencyTimer timer(latencyTracking_ ? stats_.allocateLatency_ : nullptr);
+	if (monotonic_)
+	{
+		return bumpAllocate_(numBytes, alignment);
+	}
+	size_t longCount = getBlockLongCount_(numBytes);
+	size_t* cur;
+	if (alignment <= 8)
+	{
+		if (!(cur = findFree_(longCount)))
+		{
+			++stats_.failedAllocateCount_;
+			return nullptr;
+		}
+		removeFree_(cur);
+		return occupy_(cur, longCount, numBytes, false);
+	}
+	size_t alignLong = alignment / 8;
+	// Отступ до выровненного заголовка либо нулевой, либо не короче минимального участка, поэтому он меньше alignLong + minNodeLongCount_
+	if (alignLong > endLong_ || !(cur = findFree_(longCount + alignLong - 1 + minNodeLongCount_)))
+	{
+		++stats_.failedAllocateCount_;
+		return nullptr;
+	}
+	removeFree_(cur);
+	size_t* block = alignedHeader_(cur, alignment);
+	if (block != cur)
+	{
+		block[0] = cur[0]; // Отступ перед выровненным участком остается свободным участком
+		cur[0] = reinterpret_cast<size_t>(block);
+		insertFree_(cur);
+	}
+	void* result = occupy_(block, longCount, numBytes, block != cur);
+	block[1] |= alignmentBits_(alignment); // Выравнивание запоминается, чтобы reallocate сохранил его при копировании
+	return result;
+}
+
+void Allocator::retire_(size_t* cur)
+{
+	cur[1] = canary_(cur) ^ ~(sizeMask_ | prevFreeFlag_ | alignMask_); // Метка с инвертированной канарейкой не совпадает ни с меткой занятого, ни с меткой свободного участка
+}
+
+void Allocator::release_(size_t* cur)
+{
+	size_t* next = reinterpret_cast<size_t*>(*cur);
+	if (next && isFree_(next)) // Слияние с правым свободным соседом
+	{
+		removeFree_(next);
+		*cur = *next;
+	}
+	if (cur[1] & prevFreeFlag_) // Слияние с левым свободным соседом, адрес которого записан в последней ячейке перед заголовком
+	{
+		size_t* prev = reinterpret_cast<size_t*>(*(cur - 1));
+		removeFree_(prev);
+		*prev = *cur;
+		cur[1] = 0; // Затирание метки, чтобы повторное освобождение по тому же указателю было обнаружено
+		cur = prev;
+	}
+	insertFree_(cur);
+}
+
 void Allocator::deallocate(void* ptr)
 {
+	LatencyTimer timer(latencyTracking_ ? stats_.deallocateLatency_ : nullptr);
 	if (!memLong_[0])
 	{
 		throw std::exception("Nothing to deallocate");
 	}
-	size_t* toDelete = reinterpret_cast<size_t*>(ptr) - 2; // Адрес начала заголовка участка, подлежащего удалению
-	size_t* cur = memLong_ + 1; // Адрес первого участка
-	size_t* prev = nullptr;
-	if (cur == toDelete) // Проверка переданного адреса на корректность
+	size_t* cur = reinterpret_cast<size_t*>(ptr) - 2; // Адрес начала заголовка участка, подлежащего удалению
+	if (!isUsedBlock_(cur) || (debugMode_ && !containsBlock_(cur))) // Проверка переданного адреса на корректность
 	{
 		throw std::exception("Trying to deallocate by wrong pointer");
 	}
-	while (cur != toDelete) // Проверка переданного адреса на корректность 
+	++stats_.deallocateCount_;
+	stats_.bytesInUse_ -= blockBytes_(cur);
+	--memLong_[0];
+	if (monotonic_) // Память вернется только при сбросе области
+	{
+		retire_(cur);
+		return;
+	}
+	release_(cur);
+}
+
+void Allocator::allocate(const size_t* sizes, size_t count, void** result)
+{
+	if (!count)
+	{
+		return;
+	}
+	size_t totalLongCount = 0;
+	for (size_t i = 0; i < count && totalLongCount <= endLong_; ++i)
 	{
-		prev = cur; // Запоминаем левого соседа
-		cur = reinterpret_cast<size_t*>(*cur);
-		if (!cur) // Дошли до крайнего правого, и ни один из просмотренных не совпал с переданным
+		totalLongCount += getBlockLongCount_(sizes[i]);
+	}
+	size_t* cur;
+	if (totalLongCount > endLong_ || !(cur = findFree_(totalLongCount))) // Нет участка под всю пачку - участки выделяются по одному
+	{
+		size_t i = 0;
+		try
+		{
+			for (; i < count; ++i)
+			{
+				result[i] = allocate(sizes[i]);
+			}
+		}
+		catch (const std::bad_alloc&)
+		{
+			while (i--)
+			{
+				deallocate(result[i]);
+			}
+			throw;
+		}
+		return;
+	}
+	removeFree_(cur);
+	size_t* nextNode = reinterpret_cast<size_t*>(*cur);
+	for (size_t i = 0; i + 1 < count; ++i) // Участки нарезаются подряд из одного свободного участка
+	{
+		size_t* following = cur + getBlockLongCount_(sizes[i]);
+		cur[0] = reinterpret_cast<size_t>(following);
+		cur[1] = canary_(cur) | sizes[i];
+		stats_.bytesInUse_ += sizes[i];
+		result[i] = cur + 2;
+		cur = following;
+	}
+	cur[0] = reinterpret_cast<size_t>(nextNode);
+	result[count - 1] = occupy_(cur, getBlockLongCount_(sizes[count - 1]), sizes[count - 1], false);
+	memLong_[0] += count - 1;
+	stats_.allocateCount_ += count - 1;
+}
+
+void Allocator::deallocate(void* const* ptrs, size_t count)
+{
+	if (count > memLong_[0])
+	{
+		throw std::exception("Nothing to deallocate");
+	}
+	std::vector<size_t*> blocks(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		blocks[i] = static_cast<size_t*>(ptrs[i]) - 2;
+	}
+	std::sort(blocks.begin(), blocks.end());
+	for (size_t i = 0; i < count; ++i) // Все указатели проверяются до изменения области
+	{
+		if (!isUsedBlock_(blocks[i]) || (i && blocks[i] == blocks[i - 1]) || (debugMode_ && !containsBlock_(blocks[i])))
 		{
 			throw std::exception("Trying to deallocate by wrong pointer");
 		}
 	}
-	*prev = *cur; // Передаем адрес следующего участка левому соседу
-	--memLong_[0];
+	stats_.deallocateCount_ += count;
+	for (size_t i = 0; i < count; ++i)
+	{
+		stats_.bytesInUse_ -= blockBytes_(blocks[i]);
+	}
+	memLong_[0] -= count;
+	if (monotonic_)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			retire_(blocks[i]);
+		}
+		return;
+	}
+	for (size_t i = 0; i < count; ++i) // Проход по возрастанию адресов, подряд идущие участки освобождаются одним свободным участком
+	{
+		size_t* first = blocks[i];
+		while (i + 1 < count && reinterpret_cast<size_t*>(*first) == blocks[i + 1])
+		{
+			size_t* absorbed = blocks[++i];
+			*first = *absorbed;
+			absorbed[1] = 0;
+		}
+		release_(first);
+	}
 }
 
-std::string Allocator::bitmap() const
+size_t Allocator::alignmentBits_(size_t alignment)
 {
-	std::string str;
-	for (size_t i = 0; i < sizeByte_; ++i)
+	return alignment > 8 ? highestBit(alignment) << alignShift_ : 0;
+}
+
+size_t Allocator::blockAlignment_(const size_t* node)
+{
+	size_t log = (node[1] & alignMask_) >> alignShift_;
+	return log ? size_t(1) << log : 8;
+}
+
+void* Allocator::reallocate(void* ptr, size_t numBytes)
+{
+	if (!ptr)
 	{
-		str.push_back('f');
+		return allocate(numBytes);
 	}
+	size_t* cur = static_cast<size_t*>(ptr) - 2;
+	if (!isUsedBlock_(cur) || (debugMode_ && !containsBlock_(cur)))
+	{
+		throw std::exception("Trying to reallocate by wrong pointer");
+	}
+	size_t longCount = getBlockLongCount_(numBytes);
+	size_t* end = nodeEnd_(cur);
+	size_t* next = reinterpret_cast<size_t*>(*cur);
+	if (monotonic_)
+	{
+		if (cur + longCount > end && next == bump_ && size_t(memLong_ + endLong_ - cur) >= longCount) // Последний участок растет за счет остатка области
+		{
+			size_t* rest = cur + longCount;
+			if (size_t(memLong_ + endLong_ - rest) >= minNodeLongCount_)
+			{
+				rest[0] = 0;
+				rest[1] = freeTag_;
+				cur[0] = reinterpret_cast<size_t>(rest);
+				bump_ = rest;
+			}
+			else
+			{
+				cur[0] = 0;
+				bump_ = nullptr;
+			}
+			end = nodeEnd_(cur);
+		}
+		if (cur + longCount <= end)
+		{
+			stats_.bytesInUse_ += numBytes - blockBytes_(cur);
+			cur[1] = (cur[1] & ~sizeMask_) | numBytes;
+			return ptr;
+		}
+		void* result = allocate(numBytes, blockAlignment_(cur));
+		size_t oldBytes = blockBytes_(cur);
+		std::memcpy(result, ptr, oldBytes < numBytes ? oldBytes : numBytes);
+		deallocate(ptr); // Старый участок перестает считаться занятым, его память вернется при сбросе области
+		return result;
+	}
+	if (cur + longCount > end && next && isFree_(next) && size_t(nodeEnd_(next) - cur) >= longCount) // Рост за счет правого свободного соседа
+	{
+		removeFree_(next);
+		*cur = *next;
+		end = nodeEnd_(cur);
+		next = reinterpret_cast<size_t*>(*cur);
+	}
+	if (cur + longCount <= end) // Участок помещается на месте
+	{
+		if (size_t(end - cur) >= longCount + minNodeLongCount_) // Освободившийся хвост становится свободным участком и сливается с правым свободным соседом
+		{
+			size_t* rest = cur + longCount;
+			rest[0] = cur[0];
+			cur[0] = reinterpret_cast<size_t>(rest);
+			if (next && isFree_(next))
+			{
+				removeFree_(next);
+				rest[0] = next[0];
+			}
+			insertFree_(rest);
+		}
+		else if (next && !isFree_(next))
+		{
+			next[1] &= ~prevFreeFlag_;
+		}
+		stats_.bytesInUse_ += numBytes - blockBytes_(cur);
+		cur[1] = (cur[1] & ~sizeMask_) | numBytes;
+		return ptr;
+	}
+	// Копирование - только если рядом нет места
+	void* result = allocate(numBytes, blockAlignment_(cur));
+	size_t oldBytes = blockBytes_(cur);
+	std::memcpy(result, ptr, oldBytes < numBytes ? oldBytes : numBytes);
+	deallocate(ptr);
+	return result;
+}
+
+Allocator::Pool& Allocator::getPool_(size_t poolIndex)
+{
+	if (poolIndex >= poolCount_)
+	{
+		throw std::exception("Wrong pool index");
+	}
+	return pools_[poolIndex];
+}
+
+void Allocator::pushToPool_(Pool& pool, size_t* first, size_t* last)
+{
+	unsigned long long head = pool.head_.load(std::memory_order_relaxed);
+	do
+	{
+		reinterpret_cast<std::atomic<size_t>*>(last)->store(head & poolOffsetMask_, std::memory_order_relaxed);
+	} while (!pool.head_.compare_exchange_weak(head, (head & ~poolOffsetMask_) | (first - memLong_ + 1), std::memory_order_release, std::memory_order_relaxed));
+}
+
+void Allocator::refillPool_(Pool& pool)
+{
+	std::lock_guard<std::mutex> lock(slabMutex_);
+	if (pool.head_.load(std::memory_order_acquire) & poolOffsetMask_) // Другой поток уже пополнил пул
+	{
+		return;
+	}
+	size_t* slab = static_cast<size_t*>(allocate(8 + pool.objectsPerSlab_ * pool.objectLongCount_ * 8));
+	slab[0] = reinterpret_cast<size_t>(pool.slabs_);
+	pool.slabs_ = slab;
+	size_t* first = slab + 1;
+	size_t* last = first + (pool.objectsPerSlab_ - 1) * pool.objectLongCount_;
+	for (size_t* object = first; object != last; object += pool.objectLongCount_)
+	{
+		*object = object + pool.objectLongCount_ - memLong_ + 1;
+	}
+	pushToPool_(pool, first, last);
+}
+
+size_t Allocator::registerPool(size_t objectBytes)
+{
+	if (!objectBytes || objectBytes > sizeByte_)
+	{
+		throw std::exception("Wrong pool object size");
+	}
+	if (poolCount_ == maxPoolCount_)
+	{
+		throw std::exception("Too many pools");
+	}
+	if (endLong_ > poolOffsetMask_)
+	{
+		throw std::exception("Too big memory area for pools");
+	}
+	Pool& pool = pools_[poolCount_];
+	pool.objectLongCount_ = getLongCount_(objectBytes);
+	pool.objectsPerSlab_ = minSlabBytes_ / (pool.objectLongCount_ * 8);
+	if (pool.objectsPerSlab_ < minObjectsPerSlab_)
+	{
+		pool.objectsPerSlab_ = minObjectsPerSlab_;
+	}
+	pool.slabs_ = nullptr;
+	pool.head_.store(0);
+	return poolCount_++;
+}
+
+void* Allocator::poolAllocate(size_t poolIndex)
+{
+	Pool& pool = getPool_(poolIndex);
+	unsigned long long head = pool.head_.load(std::memory_order_acquire);
+	for (;;)
+	{
+		if (!(head & poolOffsetMask_))
+		{
+			refillPool_(pool);
+			head = pool.head_.load(std::memory_order_acquire);
+			continue;
+		}
+		size_t* object = memLong_ + (head & poolOffsetMask_) - 1;
+		// Объект мог быть уже снят другим потоком, тогда прочитанное значение неверно, но сравнение вершины с обменом не пройдет благодаря счетчику снятий
+		size_t next = reinterpret_cast<std::atomic<size_t>*>(object)->load(std::memory_order_relaxed);
+		if (pool.head_.compare_exchange_weak(head, ((head & ~poolOffsetMask_) + poolTagUnit_) | next, std::memory_order_acquire, std::memory_order_acquire))
+		{
+			return object;
+		}
+	}
+}
+
+void Allocator::poolDeallocate(size_t poolIndex, void* ptr)
+{
+	Pool& pool = getPool_(poolIndex);
+	size_t* object = static_cast<size_t*>(ptr);
+	if (reinterpret_cast<size_t>(object) % 8 || object < memLong_ + 2 || object >= memLong_ + endLong_)
+	{
+		throw std::exception("Trying to deallocate by wrong pointer");
+	}
+	if (debugMode_) // Объект должен лежать на границе объекта в одной из плит пула
+	{
+		std::lock_guard<std::mutex> lock(slabMutex_);
+		size_t* slab = pool.slabs_;
+		for (; slab; slab = reinterpret_cast<size_t*>(slab[0]))
+		{
+			if (object > slab && object < slab + 1 + pool.objectsPerSlab_ * pool.objectLongCount_)
+			{
+				break;
+			}
+		}
+		if (!slab || (object - slab - 1) % pool.objectLongCount_)
+		{
+			throw std::exception("Trying to deallocate by wrong pointer");
+		}
+	}
+	pushToPool_(pool, object, object);
+}
+
+std::string Allocator::bitmap() const
+{
+	std::string str(sizeByte_, 'f');
 	for (size_t i = 0; i < 16; ++i)
 	{
 		str[i] = 's';
 	}
-	size_t* ptr = reinterpret_cast<size_t*>(memLong_[1]);
-	for (size_t i = 0; i < memLong_[0]; ++i)
+	for (size_t* ptr = reinterpret_cast<size_t*>(memLong_[1]); ptr; ptr = reinterpret_cast<size_t*>(*ptr))
 	{
+		if (isFree_(ptr))
+		{
+			continue;
+		}
 		size_t left = reinterpret_cast<unsigned char*>(ptr) - memByte_;
 		size_t right = left + 16;
 		for (size_t j = left; j < right; ++j)
@@ -132,37 +817,33 @@ std::string Allocator::bitmap() const
 			str[j] = 's';
 		}
 		left += 16;
-		right += *(ptr + 1);
+		right += blockBytes_(ptr);
 		for (size_t j = left; j < right; ++j)
 		{
 			str[j] = 'u';
 		}
-		ptr = reinterpret_cast<size_t*>(*ptr);
 	}
 	return str;
 }
 
 std::string Allocator::shortBitmap() const
 {
-	std::string str;
-	size_t size = getLongCount_(sizeByte_);
-	for (size_t i = 0; i < size; ++i)
-	{
-		str.push_back('f');
-	}
+	std::string str(getLongCount_(sizeByte_), 'f');
 	str[0] = str[1] = 's';
-	size_t* ptr = reinterpret_cast<size_t*>(memLong_[1]);
-	for (size_t i = 0; i < memLong_[0]; ++i)
+	for (size_t* ptr = reinterpret_cast<size_t*>(memLong_[1]); ptr; ptr = reinterpret_cast<size_t*>(*ptr))
 	{
+		if (isFree_(ptr))
+		{
+			continue;
+		}
 		size_t left = ptr - memLong_;
 		str[left] = str[left + 1] = 's';
 		left += 2;
-		size_t right = left + getLongCount_(*(ptr + 1));
+		size_t right = left + getLongCount_(blockBytes_(ptr));
 		for (size_t j = left; j < right; ++j)
 		{
 			str[j] = 'u';
 		}
-		ptr = reinterpret_cast<size_t*>(*ptr);
 	}
 	return str;
 }
\ No newline at end of file
@@ -2,34 +2,211 @@
 #include <new>
 #include <string>
 #include <exception>
+#include <atomic>
+#include <mutex>
 
-// Аллокатор разделяет выданную область на участки, размер которых в байтах кратен 8, за исключением, возможно, последнего, если размер области не кратен 8
+// Аллокатор разделяет выданную область на участки, размер которых в байтах кратен 8
 // Первые 16 байтов области отведены под заголовок области - первые 8 байтов содержат количество выделенных участков, следующие 8 - адрес начала заголовка первого участка
-// Участок состоит из заголовка - 8 байтов адреса на следующий блок, 8 байтов количества байт пользовательских данных на участке - и пользовательских данных
+// Участки следуют друг за другом по возрастанию адресов и покрывают всю область после заголовка области без промежутков
+// Участок состоит из заголовка - 8 байтов адреса на следующий участок, 8 байтов служебного слова - и пользовательских данных
+// Служебное слово занятого участка: младшие 47 битов - количество байт пользовательских данных, 47-й бит - признак того, что левый сосед свободен,
+// старшие 16 битов - контрольная метка, зависящая от адреса участка. По метке указатель при освобождении проверяется без обхода списка участков
+// Участок занимает место от своего заголовка до заголовка следующего участка (или до конца области), поэтому за пользовательскими данными может оставаться неиспользуемый хвост
+// Свободное место также оформлено в виде участков - у свободного участка вместо количества байтов записана метка freeTag_,
+// следующие 16 байтов содержат адреса предыдущего и следующего свободных участков той же корзины, а последние 8 байтов участка - адрес его заголовка
+// По последней ячейке освобождаемый участок находит своего свободного левого соседа за O(1)
+// Свободные участки разложены по корзинам по своей длине в 8-байтных ячейках: короткие участки - в корзины точного размера, длинные - в корзины по степеням двойки,
+// разбитым на binsPerPowerOfTwo_ частей. Непустые корзины отмечены в битовой маске, что позволяет находить подходящий участок за O(1)
+// При освобождении участок сливается с соседними свободными участками
+
+// Для объектов фиксированного размера можно зарегистрировать пул. Пул выделяет из области участки-плиты и нарезает их на объекты без заголовков
+// Первые 8 байтов плиты - адрес следующей плиты пула, далее подряд идут объекты
+// Свободные объекты пула образуют стек без блокировок: первые 8 байтов свободного объекта - смещение следующего свободного объекта
+// Вершина стека хранит смещение объекта в 8-байтных ячейках от начала области, увеличенное на 1, в младших 40 битах и счетчик снятий в старших 24 битах против ABA
+// Методы пулов можно вызывать из нескольких потоков одновременно. Новая плита берется из области через allocate под общим мьютексом пулов,
+// поэтому вызовы allocate и deallocate из других потоков должны быть синхронизированы с методами пулов извне
+
+// Статистика аллокатора. Счетчики поддерживаются при каждой операции, снимок строится за время, не зависящее от размера области
+struct AllocatorStats
+{
+	// Количество корзин гистограмм: i-я корзина считает значения из диапазона [2^i, 2^(i+1))
+	static const size_t histogramSize = 64;
+	size_t blockCount_; // Количество выделенных участков
+	size_t bytesInUse_; // Байтов пользовательских данных в выделенных участках
+	size_t headerBytes_; // Байтов, занятых заголовками выделенных участков
+	size_t freeBytes_; // Байтов в свободных участках
+	size_t freeBlockCount_; // Количество свободных участков
+	size_t largestFreeBlock_; // Длина наибольшего свободного участка в байтах
+	size_t freeHistogram_[histogramSize]; // Гистограмма длин свободных участков в байтах
+	unsigned long long allocateCount_; // Количество выделенных участков за все время
+	unsigned long long deallocateCount_; // Количество освобожденных участков за все время
+	unsigned long long failedAllocateCount_; // Количество выделений, завершившихся std::bad_alloc из-за нехватки места
+	unsigned long long allocateLatency_[histogramSize]; // Гистограмма времени allocate в наносекундах, заполняется при включенном замере
+	unsigned long long deallocateLatency_[histogramSize]; // Гистограмма времени deallocate в наносекундах, заполняется при включенном замере
+};
 
 class Allocator
 {
 private:
+	// Количество корзин точного размера. Свободный участок длиной меньше smallBinCount_ ячеек лежит в корзине с номером, равным его длине
+	static const size_t smallBinCount_ = 64;
+	// Двоичный логарифм smallBinCount_
+	static const size_t smallBinLog_ = 6;
+	// Количество корзин на каждую степень двойки для участков длиной от smallBinCount_ ячеек
+	static const size_t binsPerPowerOfTwo_ = 4;
+	// Общее количество корзин
+	static const size_t binCount_ = smallBinCount_ + (64 - smallBinLog_) * binsPerPowerOfTwo_;
+	// Минимальная длина участка в ячейках - заголовок, две ссылки списка свободных участков и адрес заголовка в конце
+	static const size_t minNodeLongCount_ = 5;
+	// Метка свободного участка во второй ячейке заголовка
+	static const size_t freeTag_ = ~size_t(0);
+	// Маска количества байт пользовательских данных в служебном слове занятого участка
+	static const size_t sizeMask_ = (size_t(1) << 41) - 1;
+	// Сдвиг и маска двоичного логарифма выравнивания, запрошенного для занятого участка, в служебном слове. 0 - выравнивание по умолчанию
+	static const size_t alignShift_ = 41;
+	static const size_t alignMask_ = size_t(63) << alignShift_;
+	// Признак свободного левого соседа в служебном слове занятого участка
+	static const size_t prevFreeFlag_ = size_t(1) << 47;
+	// Основа контрольной метки занятого участка
+	static const size_t usedMagic_ = 0xA110;
+	// Максимальное количество пулов
+	static const size_t maxPoolCount_ = 16;
+	// Маска смещения объекта в вершине стека пула
+	static const unsigned long long poolOffsetMask_ = (1ull << 40) - 1;
+	// Единица счетчика снятий в вершине стека пула
+	static const unsigned long long poolTagUnit_ = 1ull << 40;
+	// Минимальный размер плиты в байтах и минимальное количество объектов в плите
+	static const size_t minSlabBytes_ = 4096;
+	static const size_t minObjectsPerSlab_ = 16;
+	struct Pool
+	{
+		// Вершина стека свободных объектов
+		std::atomic<unsigned long long> head_;
+		// Размер объекта в 8-байтных ячейках
+		size_t objectLongCount_;
+		size_t objectsPerSlab_;
+		// Первая плита пула
+		size_t* slabs_;
+	};
 	// Указатель на выделенную область как массив байтов
 	unsigned char* memByte_;
 	// Указатель на выделенную область как массив 64-битных целых чисел
 	size_t* memLong_;
 	// Размер выделенной области в байтах
-	size_t sizeByte_; 
-	// Поиск свободного места под участок размером bytesCount байтов
-	// Возвращает указатель на начало заголовка предполагаемого участка, или nullptr, если память выделить нельзя
-	// Записывает в prev и next адреса начал заголовков двух соседних участков
-	// Если участок крайний левый, в prev записывается адрес ячейки заголовка области
-	// Если участок крайний правый, в next записывается nullptr
-	size_t* findFree_(size_t bytesCount, size_t*& prev, size_t*& next) const; 
+	size_t sizeByte_;
+	// Количество целых 8-байтных ячеек в области
+	size_t endLong_;
+	// Первые свободные участки каждой корзины
+	size_t* bins_[binCount_];
+	// Битовая маска непустых корзин
+	unsigned long long binMask_[(binCount_ + 63) / 64];
+	// Режим отладки - при освобождении указатель дополнительно ищется обходом всего списка участков или плит пула
+	bool debugMode_;
+	Pool pools_[maxPoolCount_];
+	size_t poolCount_;
+	// Мьютекс выделения новых плит, общий для всех пулов области
+	std::mutex slabMutex_;
+	// Монотонный режим - участки выделяются подряд сдвигом границы, deallocate ничего не освобождает, память возвращается только сбросом области
+	bool monotonic_;
+	// Свободный участок в конце области, от которого отрезаются участки в монотонном режиме, в корзины не входит
+	size_t* bump_;
+	// Количество свободных участков в каждой корзине
+	size_t binCounts_[binCount_];
+	// Счетчики статистики. Поля снимка, вычисляемые по корзинам, здесь не поддерживаются
+	AllocatorStats stats_;
+	// Замер времени allocate и deallocate
+	bool latencyTracking_;
+	// Поиск свободного участка длиной не меньше longCount ячеек
+	// Возвращает указатель на начало заголовка свободного участка, или nullptr, если память выделить нельзя
+	size_t* findFree_(size_t longCount) const;
+	// Возвращает указатель на конец участка - на заголовок следующего участка или на конец области
+	size_t* nodeEnd_(const size_t* node) const;
+	// Является ли участок свободным
+	static bool isFree_(const size_t* node);
+	// Возвращает контрольную метку занятого участка, сдвинутую в старшие биты служебного слова
+	static size_t canary_(const size_t* node);
+	// Возвращает количество байт пользовательских данных занятого участка
+	static size_t blockBytes_(const size_t* node);
+	// Проверяет, что по адресу node лежит заголовок занятого участка: адрес внутри области, метка и ссылка на следующий участок корректны
+	bool isUsedBlock_(const size_t* node) const;
+	// Проверяет обходом списка, что участок node входит в список участков области
+	bool containsBlock_(const size_t* node) const;
+	// Возвращает номер корзины для свободного участка длиной longCount ячеек
+	static size_t binIndex_(size_t longCount);
+	// Помечает участок свободным и добавляет его в корзину
+	void insertFree_(size_t* node);
+	// Удаляет свободный участок из его корзины
+	void removeFree_(size_t* node);
+	// Возвращает пул по номеру, выбрасывает исключение для незарегистрированного номера
+	Pool& getPool_(size_t poolIndex);
+	// Выделяет пулу новую плиту, если стек свободных объектов пуст
+	void refillPool_(Pool& pool);
+	// Кладет цепочку свободных объектов от first до last в стек пула
+	void pushToPool_(Pool& pool, size_t* first, size_t* last);
+	// Возвращает длину в ячейках участка под numBytes байтов, выбрасывает std::bad_alloc для нулевого или слишком большого размера
+	size_t getBlockLongCount_(size_t numBytes) const;
+	// Занимает начало свободного участка cur, уже удаленного из корзины, под участок длиной longCount ячеек, остаток возвращает в корзины
+	// prevFree - свободен ли левый сосед участка. Возвращает указатель на пользовательские данные
+	void* occupy_(size_t* cur, size_t longCount, size_t numBytes, bool prevFree);
+	// Возвращает адрес заголовка участка внутри свободного участка cur, при котором пользовательские данные выровнены по alignment,
+	// а отступ от cur либо нулевой, либо не короче минимального участка
+	size_t* alignedHeader_(size_t* cur, size_t alignment) const;
+	// Возвращает биты служебного слова, хранящие выравнивание alignment, запрошенное для участка
+	static size_t alignmentBits_(size_t alignment);
+	// Возвращает выравнивание, запрошенное при выделении занятого участка
+	static size_t blockAlignment_(const size_t* node);
+	// Выделение в монотонном режиме. Возвращает nullptr, если места нет
+	void* bumpAllocate_(size_t numBytes, size_t alignment);
+	// Освобождает проверенный занятый участок, сливая его с соседними свободными участками. Счетчик участков не изменяет
+	void release_(size_t* cur);
+	// Освобождает проверенный занятый участок в монотонном режиме: участок остается в списке, но больше не считается занятым,
+	// поэтому повторное освобождение обнаруживается. Счетчик участков не изменяет
+	void retire_(size_t* cur);
 	// Возвращает результат деления числа на 8 с округлением вверх
 	static size_t getLongCount_(size_t bytesCount);
 public:
 	Allocator(void* mem, size_t totalBytes);
 	void* allocate(size_t numBytes);
+	// Аллоцировать numBytes байтов так, чтобы адрес пользовательских данных был кратен alignment (степени двойки)
+	// Отступ перед выровненным участком остается свободным участком, если он не короче минимального участка
+	void* allocate(size_t numBytes, size_t alignment);
+	// То же, что allocate, но при нехватке памяти возвращает nullptr вместо исключения
+	void* tryAllocate(size_t numBytes, size_t alignment);
 	void deallocate(void* ptr);
+	// Аллоцирует count участков размерами sizes[i] байтов и записывает указатели в result
+	// Если есть свободный участок под всю пачку, участки нарезаются из него подряд за один проход
+	// При нехватке памяти уже выделенные этим вызовом участки освобождаются и выбрасывается std::bad_alloc
+	void allocate(const size_t* sizes, size_t count, void** result);
+	// Деаллоцирует count участков по указателям ptrs за один проход по возрастанию адресов
+	// Все указатели проверяются до освобождения, при ошибке ни один участок не освобождается
+	void deallocate(void* const* ptrs, size_t count);
+	// Изменяет размер участка до numBytes байтов. Участок растет или сжимается на месте, если справа хватает свободного места,
+	// иначе данные копируются в новый участок. Возвращает указатель на данные, при ptr == nullptr работает как allocate
+	// При копировании сохраняется выравнивание, запрошенное при выделении участка
+	void* reallocate(void* ptr, size_t numBytes);
+	// Сбрасывает область за O(1): все участки и плиты пулов считаются освобожденными, регистрация пулов сохраняется
+	// Нельзя вызывать одновременно с методами пулов
+	void reset();
+	// Включает или выключает монотонный режим. Переключать режим можно только в пустой области, область при этом сбрасывается
+	// В монотонном режиме deallocate уменьшает счетчики занятых участков и байтов, но память освобожденных участков
+	// возвращается только при reset() или при выключении режима, которое тоже сбрасывает область
+	void setMonotonicMode(bool enabled);
+	// Возвращает количество выделенных участков
+	size_t blockCount() const;
+	// Возвращает снимок статистики за O(количество корзин)
+	AllocatorStats stats() const;
+	// Включает или выключает замер времени allocate и deallocate
+	void setLatencyTracking(bool enabled);
+	// Включает или выключает режим отладки
+	void setDebugMode(bool enabled);
+	// Регистрирует пул объектов размером objectBytes байтов, возвращает номер пула
+	size_t registerPool(size_t objectBytes);
+	// Выделяет объект из пула
+	void* poolAllocate(size_t poolIndex);
+	// Возвращает объект в пул
+	void poolDeallocate(size_t poolIndex, void* ptr);
 	// Возвращает байтовый битмап
 	std::string bitmap() const;
 	// Возвращает битмап блоками по 8 байт
-	std::string shortBitmap() const; 
+	std::string shortBitmap() const;
 };
\ No newline at end of file
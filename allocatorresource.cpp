@@ -0,0 +1,31 @@
+﻿#include "allocatorresource.h"
+
+AllocatorResource::AllocatorResource(Allocator& allocator) : allocator_(allocator)
+{
+}
+
+void* AllocatorResource::do_allocate(size_t bytes, size_t alignment)
+{
+	return allocator_.allocate(bytes ? bytes : 1, alignment);
+}
+
+void AllocatorResource::do_deallocate(void* ptr, size_t, size_t)
+{
+	allocator_.deallocate(ptr);
+}
+
+bool AllocatorResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+	const AllocatorResource* resource = dynamic_cast<const AllocatorResource*>(&other);
+	return resource && &resource->allocator_ == &allocator_;
+}
+
+void AllocatorResource::release()
+{
+	allocator_.reset();
+}
+
+Allocator& AllocatorResource::allocator() const
+{
+	return allocator_;
+}
\ No newline at end of file
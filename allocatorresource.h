@@ -0,0 +1,21 @@
+﻿#pragma once
+#include <memory_resource>
+#include "allocator.h"
+
+// Адаптер Allocator к интерфейсу std::pmr::memory_resource, позволяющий размещать стандартные контейнеры в области аллокатора
+// Адаптер не владеет аллокатором. Запросы нулевого размера обслуживаются участком в 1 байт
+// release() сбрасывает всю область аллокатора, после этого память, выданная контейнерам, больше не действительна
+
+class AllocatorResource : public std::pmr::memory_resource
+{
+private:
+	Allocator& allocator_;
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+public:
+	explicit AllocatorResource(Allocator& allocator);
+	// Сбрасывает область аллокатора за O(1)
+	void release();
+	Allocator& allocator() const;
+};
\ No newline at end of file
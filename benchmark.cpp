@@ -0,0 +1,450 @@
+﻿#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <atomic>
+#include "allocator.h"
+#include "threadallocator.h"
+
+// Бенчмарк аллокаторов на трассах выделений
+// Трасса - последовательность операций: выделить участок с номером id размером size, или освободить участок с номером id
+// Синтетические трассы: размеры равномерные или со степенным распределением, освобождение в порядке LIFO или FIFO
+// Файл трассы - текстовый, по операции в строке: "a <id> <size>" или "f <id>"
+// Выделять можно только неживой номер, освобождать - только живой, номера меньше maxTraceIdCount. Ошибочная строка останавливает запуск
+// Каждый поток воспроизводит свою копию трассы. Измеряются операции в секунду, медиана и 99-й перцентиль задержки операции,
+// а для Allocator в одном потоке - пиковая фрагментация: 1 - (наибольший свободный участок) / (все свободные байты)
+// На трассах, где все участки одного размера, испытывается и пул объектов Allocator (registerPool)
+//
+// Запуск: benchmark [-t trace.txt] [-n количество_выделений] [-p максимум_потоков] [-r размер_области_МБ]
+
+struct TraceOp
+{
+	bool isAllocate_;
+	size_t id_;
+	size_t size_;
+};
+
+struct Trace
+{
+	std::string name_;
+	std::vector<TraceOp> ops_;
+	size_t idCount_;
+};
+
+struct BenchResult
+{
+	double opsPerSecond_;
+	double p50_;
+	double p99_;
+	double peakFragmentation_; // Меньше нуля, если не измерялась
+};
+
+// Наибольшее количество номеров участков в трассе из файла
+static const size_t maxTraceIdCount = size_t(1) << 24;
+
+// Интерфейс испытуемого аллокатора
+class BenchAllocator
+{
+public:
+	virtual ~BenchAllocator() {}
+	virtual const char* name() const = 0;
+	virtual void* allocate(size_t numBytes) = 0;
+	virtual void deallocate(void* ptr) = 0;
+	// Возвращает текущую фрагментацию или число меньше нуля, если аллокатор ее не сообщает
+	virtual double fragmentation() const { return -1; }
+};
+
+class MallocBench : public BenchAllocator
+{
+public:
+	const char* name() const override { return "malloc"; }
+	void* allocate(size_t numBytes) override { return std::malloc(numBytes); }
+	void deallocate(void* ptr) override { std::free(ptr); }
+};
+
+// Allocator под одним мьютексом - так его приходится использовать из нескольких потоков
+class LockedAllocatorBench : public BenchAllocator
+{
+private:
+	std::vector<size_t> memory_;
+	Allocator allocator_;
+	std::mutex mutex_;
+	bool locked_;
+public:
+	LockedAllocatorBench(size_t totalBytes, bool locked) : memory_(totalBytes / 8), allocator_(memory_.data(), totalBytes), locked_(locked) {}
+	const char* name() const override { return locked_ ? "Allocator+mutex" : "Allocator"; }
+	void* allocate(size_t numBytes) override
+	{
+		if (!locked_)
+		{
+			return allocator_.allocate(numBytes);
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		return allocator_.allocate(numBytes);
+	}
+	void deallocate(void* ptr) override
+	{
+		if (!locked_)
+		{
+			allocator_.deallocate(ptr);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		allocator_.deallocate(ptr);
+	}
+	double fragmentation() const override
+	{
+		AllocatorStats stats = allocator_.stats();
+		return stats.freeBytes_ ? 1 - double(stats.largestFreeBlock_) / stats.freeBytes_ : 0;
+	}
+};
+
+// Пул объектов Allocator: плиты по объектам одного размера, выделение и освобождение без блокировки
+// Подходит только для трасс, где все участки одного размера
+class PoolBench : public BenchAllocator
+{
+private:
+	std::vector<size_t> memory_;
+	Allocator allocator_;
+	size_t pool_;
+public:
+	PoolBench(size_t totalBytes, size_t objectBytes) : memory_(totalBytes / 8), allocator_(memory_.data(), totalBytes), pool_(allocator_.registerPool(objectBytes)) {}
+	const char* name() const override { return "Allocator pool"; }
+	void* allocate(size_t) override { return allocator_.poolAllocate(pool_); }
+	void deallocate(void* ptr) override { allocator_.poolDeallocate(pool_, ptr); }
+};
+
+class ThreadCachingBench : public BenchAllocator
+{
+private:
+	std::vector<size_t> memory_;
+	ThreadCachingAllocator allocator_;
+public:
+	ThreadCachingBench(size_t totalBytes, size_t regionCount) : memory_(totalBytes / 8), allocator_(memory_.data(), totalBytes, regionCount) {}
+	const char* name() const override { return "ThreadCachingAllocator"; }
+	void* allocate(size_t numBytes) override { return allocator_.allocate(numBytes); }
+	void deallocate(void* ptr) override { allocator_.deallocate(ptr); }
+};
+
+// Степенное распределение размеров: маленьких участков много, больших - мало
+static size_t powerLawSize(std::mt19937& rng, size_t maxSize)
+{
+	double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+	size_t size = size_t(std::pow(double(maxSize), u * u));
+	return size ? size : 1;
+}
+
+// Синтетическая трасса: liveCount участков живут одновременно, каждое следующее выделение вытесняет участок по правилу LIFO или FIFO
+static Trace syntheticTrace(const std::string& name, size_t allocCount, size_t liveCount, bool powerLaw, bool lifo, size_t maxSize)
+{
+	Trace trace;
+	trace.name_ = name;
+	trace.idCount_ = allocCount;
+	std::mt19937 rng(42);
+	std::vector<size_t> live;
+	size_t head = 0; // Начало очереди для FIFO
+	for (size_t id = 0; id < allocCount; ++id)
+	{
+		if (live.size() - head >= liveCount)
+		{
+			size_t victim;
+			if (lifo)
+			{
+				// Стек с небольшим разбросом глубины, иначе LIFO вырождается в повторное выделение одного и того же участка
+				size_t depth = rng() % 4;
+				depth = depth < live.size() - head ? depth : 0;
+				victim = live[live.size() - 1 - depth];
+				live.erase(live.end() - 1 - depth);
+			}
+			else
+			{
+				victim = live[head++];
+			}
+			trace.ops_.push_back({ false, victim, 0 });
+		}
+		size_t size = powerLaw ? powerLawSize(rng, maxSize) : 1 + rng() % maxSize;
+		trace.ops_.push_back({ true, id, size });
+		live.push_back(id);
+	}
+	for (size_t i = head; i < live.size(); ++i)
+	{
+		trace.ops_.push_back({ false, live[i], 0 });
+	}
+	return trace;
+}
+
+// Трасса из участков одного размера size с тем же порядком выделений и освобождений, что у syntheticTrace
+static Trace fixedSizeTrace(const std::string& name, size_t allocCount, size_t liveCount, bool lifo, size_t size)
+{
+	Trace trace = syntheticTrace(name, allocCount, liveCount, false, lifo, 1);
+	for (TraceOp& op : trace.ops_)
+	{
+		if (op.isAllocate_)
+		{
+			op.size_ = size;
+		}
+	}
+	return trace;
+}
+
+// Возвращает размер участков, если все выделения трассы одного размера, иначе 0
+static size_t singleSize(const Trace& trace)
+{
+	size_t size = 0;
+	for (const TraceOp& op : trace.ops_)
+	{
+		if (!op.isAllocate_)
+		{
+			continue;
+		}
+		if (size && op.size_ != size)
+		{
+			return 0;
+		}
+		size = op.size_;
+	}
+	return size;
+}
+
+// Ошибка в строке lineNumber файла трассы
+static std::exception traceError(const char* message, size_t lineNumber)
+{
+	std::string text = std::string(message) + " at trace line " + std::to_string(lineNumber);
+	return std::exception(text.c_str());
+}
+
+// Читает трассу из файла. Пустые строки пропускаются, неизвестная операция, номер вне диапазона,
+// повторное выделение живого участка и освобождение неживого участка считаются ошибкой с номером строки
+static Trace readTrace(const std::string& fileName)
+{
+	std::ifstream file(fileName);
+	if (!file)
+	{
+		throw std::exception("Can not open trace file");
+	}
+	Trace trace;
+	trace.name_ = fileName;
+	trace.idCount_ = 0;
+	std::vector<bool> live; // Живые участки по номерам
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(file, line); ++lineNumber)
+	{
+		std::istringstream stream(line);
+		char op;
+		if (!(stream >> op))
+		{
+			continue;
+		}
+		TraceOp traceOp = { op == 'a', 0, 0 };
+		if (op != 'a' && op != 'f')
+		{
+			throw traceError("Unknown operation", lineNumber);
+		}
+		if (!(stream >> traceOp.id_) || (traceOp.isAllocate_ && (!(stream >> traceOp.size_) || !traceOp.size_)))
+		{
+			throw traceError("Wrong trace file format", lineNumber);
+		}
+		if (traceOp.id_ >= maxTraceIdCount) // Номер - индекс в массиве указателей каждого потока
+		{
+			throw traceError("Too big block id", lineNumber);
+		}
+		if (traceOp.id_ >= live.size())
+		{
+			live.resize(traceOp.id_ + 1);
+		}
+		if (live[traceOp.id_] == traceOp.isAllocate_)
+		{
+			throw traceError(traceOp.isAllocate_ ? "Allocating a live block id" : "Freeing a block id that is not live", lineNumber);
+		}
+		live[traceOp.id_] = traceOp.isAllocate_;
+		trace.ops_.push_back(traceOp);
+	}
+	trace.idCount_ = live.size();
+	return trace;
+}
+
+static double percentile(std::vector<unsigned>& samples, double fraction)
+{
+	if (samples.empty())
+	{
+		return 0;
+	}
+	size_t index = size_t(fraction * (samples.size() - 1));
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+// Воспроизводит трассу в threadCount потоках. Фрагментация замеряется только в одном потоке, раз в 1024 операции
+static BenchResult run(BenchAllocator& allocator, const Trace& trace, size_t threadCount)
+{
+	std::vector<std::vector<unsigned>> latencies(threadCount);
+	double peakFragmentation = -1;
+	std::atomic<bool> outOfMemory(false);
+	auto worker = [&](size_t threadIndex)
+	{
+		std::vector<void*> ptrs(trace.idCount_, nullptr);
+		std::vector<unsigned>& samples = latencies[threadIndex];
+		samples.reserve(trace.ops_.size());
+		for (size_t i = 0; i < trace.ops_.size(); ++i)
+		{
+			const TraceOp& op = trace.ops_[i];
+			auto start = std::chrono::steady_clock::now();
+			if (op.isAllocate_)
+			{
+				try
+				{
+					ptrs[op.id_] = allocator.allocate(op.size_);
+				}
+				catch (const std::bad_alloc&) // Исключение не должно покинуть поток
+				{
+					outOfMemory = true;
+					return;
+				}
+			}
+			else if (ptrs[op.id_])
+			{
+				allocator.deallocate(ptrs[op.id_]);
+				ptrs[op.id_] = nullptr;
+			}
+			samples.push_back(unsigned(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+			if (threadCount == 1 && !(i % 1024))
+			{
+				peakFragmentation = std::max(peakFragmentation, allocator.fragmentation());
+			}
+		}
+	};
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		threads.emplace_back(worker, i);
+	}
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		threads[i].join();
+	}
+	if (outOfMemory)
+	{
+		throw std::bad_alloc();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::vector<unsigned> all;
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+	}
+	BenchResult result;
+	result.opsPerSecond_ = all.size() / seconds;
+	result.p50_ = percentile(all, 0.5);
+	result.p99_ = percentile(all, 0.99);
+	result.peakFragmentation_ = peakFragmentation;
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	std::string traceFile;
+	size_t allocCount = 200000;
+	size_t maxThreads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+	size_t regionBytes = size_t(64) << 20;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (!std::strcmp(argv[i], "-t"))
+		{
+			traceFile = argv[i + 1];
+		}
+		else if (!std::strcmp(argv[i], "-n"))
+		{
+			allocCount = std::strtoull(argv[i + 1], nullptr, 10);
+		}
+		else if (!std::strcmp(argv[i], "-p"))
+		{
+			maxThreads = std::strtoull(argv[i + 1], nullptr, 10);
+		}
+		else if (!std::strcmp(argv[i], "-r"))
+		{
+			regionBytes = std::strtoull(argv[i + 1], nullptr, 10) << 20;
+		}
+	}
+	std::vector<Trace> traces;
+	if (!traceFile.empty())
+	{
+		try
+		{
+			traces.push_back(readTrace(traceFile));
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+	else
+	{
+		traces.push_back(syntheticTrace("uniform-lifo", allocCount, 1000, false, true, 512));
+		traces.push_back(syntheticTrace("uniform-fifo", allocCount, 1000, false, false, 512));
+		traces.push_back(syntheticTrace("powerlaw-lifo", allocCount, 1000, true, true, 1 << 16));
+		traces.push_back(syntheticTrace("powerlaw-fifo", allocCount, 1000, true, false, 1 << 16));
+		traces.push_back(fixedSizeTrace("fixed64-lifo", allocCount, 1000, true, 64));
+		traces.push_back(fixedSizeTrace("fixed64-fifo", allocCount, 1000, false, 64));
+	}
+	std::vector<size_t> threadCounts; // Степени двойки до maxThreads и сам maxThreads
+	for (size_t threads = 1; threads < maxThreads; threads *= 2)
+	{
+		threadCounts.push_back(threads);
+	}
+	threadCounts.push_back(maxThreads);
+	std::cout << std::left << std::setw(16) << "trace" << std::setw(24) << "allocator" << std::setw(9) << "threads"
+		<< std::setw(14) << "ops/sec" << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns" << "peak frag" << std::endl;
+	for (const Trace& trace : traces)
+	{
+		size_t objectBytes = singleSize(trace);
+		for (size_t threads : threadCounts)
+		{
+			std::vector<std::unique_ptr<BenchAllocator>> allocators;
+			allocators.emplace_back(new MallocBench());
+			allocators.emplace_back(new LockedAllocatorBench(regionBytes, threads > 1));
+			allocators.emplace_back(new ThreadCachingBench(regionBytes, threads));
+			if (objectBytes)
+			{
+				allocators.emplace_back(new PoolBench(regionBytes, objectBytes));
+			}
+			for (auto& allocator : allocators)
+			{
+				BenchResult result;
+				try
+				{
+					result = run(*allocator, trace, threads);
+				}
+				catch (const std::bad_alloc&)
+				{
+					std::cout << std::setw(16) << trace.name_ << std::setw(24) << allocator->name() << std::setw(9) << threads << "out of memory" << std::endl;
+					continue;
+				}
+				std::cout << std::setw(16) << trace.name_ << std::setw(24) << allocator->name() << std::setw(9) << threads
+					<< std::setw(14) << size_t(result.opsPerSecond_) << std::setw(10) << size_t(result.p50_) << std::setw(10) << size_t(result.p99_);
+				if (result.peakFragmentation_ >= 0)
+				{
+					std::cout << std::fixed << std::setprecision(3) << result.peakFragmentation_ << std::defaultfloat;
+				}
+				else
+				{
+					std::cout << "-";
+				}
+				std::cout << std::endl;
+			}
+		}
+	}
+	return 0;
+}
\ No newline at end of file
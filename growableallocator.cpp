@@ -0,0 +1,159 @@
+﻿#include "growableallocator.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+GrowableAllocator::GrowableAllocator(size_t chunkBytes, bool hugePages)
+{
+	chunkBytes_ = chunkBytes;
+	hugePages_ = hugePages;
+	current_ = &mapChunk_(chunkBytes_);
+}
+
+GrowableAllocator::~GrowableAllocator()
+{
+	while (!chunks_.empty())
+	{
+		unmapChunk_(chunks_.begin());
+	}
+}
+
+size_t GrowableAllocator::pageSize_()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+GrowableAllocator::Chunk& GrowableAllocator::mapChunk_(size_t minBytes)
+{
+	size_t bytes = minBytes > chunkBytes_ ? minBytes : chunkBytes_;
+	size_t granularity = hugePages_ ? hugePageSize_ : pageSize_();
+	bytes = (bytes + granularity - 1) / granularity * granularity;
+#ifdef _WIN32
+	// Большие страницы в Windows требуют привилегии SeLockMemoryPrivilege, поэтому hugePages здесь влияет только на размер куска
+	void* mem = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!mem)
+	{
+		throw std::bad_alloc();
+	}
+#else
+	void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		throw std::bad_alloc();
+	}
+#ifdef MADV_HUGEPAGE
+	if (hugePages_)
+	{
+		madvise(mem, bytes, MADV_HUGEPAGE);
+	}
+#endif
+#endif
+	Chunk chunk;
+	chunk.mem_ = static_cast<unsigned char*>(mem);
+	chunk.bytes_ = bytes;
+	chunk.allocator_.reset(new Allocator(mem, bytes));
+	return chunks_.insert(std::make_pair(chunk.mem_, std::move(chunk))).first->second;
+}
+
+void GrowableAllocator::unmapChunk_(std::map<unsigned char*, Chunk>::iterator it)
+{
+#ifdef _WIN32
+	VirtualFree(it->second.mem_, 0, MEM_RELEASE);
+#else
+	munmap(it->second.mem_, it->second.bytes_);
+#endif
+	chunks_.erase(it);
+}
+
+std::map<unsigned char*, GrowableAllocator::Chunk>::iterator GrowableAllocator::findChunk_(const void* ptr)
+{
+	const unsigned char* bytePtr = static_cast<const unsigned char*>(ptr);
+	auto it = chunks_.upper_bound(const_cast<unsigned char*>(bytePtr));
+	if (it == chunks_.begin())
+	{
+		return chunks_.end();
+	}
+	--it;
+	return bytePtr < it->second.mem_ + it->second.bytes_ ? it : chunks_.end();
+}
+
+void* GrowableAllocator::allocate(size_t numBytes)
+{
+	return allocate(numBytes, 8);
+}
+
+void* GrowableAllocator::allocate(size_t numBytes, size_t alignment)
+{
+	if (!numBytes)
+	{
+		throw std::bad_alloc();
+	}
+	if (void* result = current_->allocator_->tryAllocate(numBytes, alignment))
+	{
+		return result;
+	}
+	for (auto it = chunks_.begin(); it != chunks_.end(); ++it)
+	{
+		if (&it->second == current_)
+		{
+			continue;
+		}
+		if (void* result = it->second.allocator_->tryAllocate(numBytes, alignment))
+		{
+			switchCurrent_(it->second);
+			return result;
+		}
+	}
+	// Запас на заголовок области, заголовок участка, выравнивание и свободный участок перед выровненным участком
+	if (numBytes > ~size_t(0) - alignment - 128)
+	{
+		throw std::bad_alloc();
+	}
+	Chunk& chunk = mapChunk_(numBytes + alignment + 128);
+	void* result = chunk.allocator_->tryAllocate(numBytes, alignment);
+	if (!result)
+	{
+		unmapChunk_(chunks_.find(chunk.mem_));
+		throw std::bad_alloc();
+	}
+	switchCurrent_(chunk);
+	return result;
+}
+
+void GrowableAllocator::switchCurrent_(Chunk& chunk)
+{
+	Chunk* previous = current_;
+	current_ = &chunk;
+	if (!previous->allocator_->blockCount()) // Прежний текущий кусок пуст - при освобождении его пропускали, поэтому он возвращается ОС здесь
+	{
+		unmapChunk_(chunks_.find(previous->mem_));
+	}
+}
+
+void GrowableAllocator::deallocate(void* ptr)
+{
+	auto it = findChunk_(ptr);
+	if (it == chunks_.end())
+	{
+		throw std::exception("Trying to deallocate by wrong pointer");
+	}
+	it->second.allocator_->deallocate(ptr);
+	if (!it->second.allocator_->blockCount() && &it->second != current_)
+	{
+		unmapChunk_(it);
+	}
+}
+
+size_t GrowableAllocator::chunkCount() const
+{
+	return chunks_.size();
+}
\ No newline at end of file
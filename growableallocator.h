@@ -0,0 +1,48 @@
+﻿#pragma once
+#include <map>
+#include <memory>
+#include "allocator.h"
+
+// Аллокатор, растущий по мере надобности. Память запрашивается у ОС кусками (mmap или VirtualAlloc), в каждом куске работает свой Allocator
+// Выделение сначала пробует кусок, в котором прошло последнее выделение, затем остальные куски, и только затем запрашивает новый кусок
+// Размер нового куска - chunkBytes, или больше, если запрос в него не помещается
+// Кусок, в котором не осталось занятых участков, возвращается ОС, если это не текущий кусок. Опустевший текущий кусок возвращается, когда текущим становится другой
+// При hugePages на Linux для кусков запрашиваются большие страницы через madvise(MADV_HUGEPAGE), а размер кусков округляется до 2 МБ
+
+class GrowableAllocator
+{
+private:
+	// Размер большой страницы, до которого округляются куски при hugePages
+	static const size_t hugePageSize_ = 2 << 20;
+	struct Chunk
+	{
+		unsigned char* mem_;
+		size_t bytes_;
+		std::unique_ptr<Allocator> allocator_;
+	};
+	size_t chunkBytes_;
+	bool hugePages_;
+	// Куски по адресам их начала
+	std::map<unsigned char*, Chunk> chunks_;
+	// Кусок, в котором прошло последнее выделение
+	Chunk* current_;
+	static size_t pageSize_();
+	// Запрашивает у ОС кусок не меньше minBytes байтов
+	Chunk& mapChunk_(size_t minBytes);
+	// Возвращает кусок ОС
+	void unmapChunk_(std::map<unsigned char*, Chunk>::iterator it);
+	// Делает кусок текущим, возвращая ОС прежний текущий кусок, если в нем нет занятых участков
+	void switchCurrent_(Chunk& chunk);
+	// Возвращает кусок, которому принадлежит указатель, или chunks_.end()
+	std::map<unsigned char*, Chunk>::iterator findChunk_(const void* ptr);
+public:
+	GrowableAllocator(size_t chunkBytes, bool hugePages = false);
+	~GrowableAllocator();
+	GrowableAllocator(const GrowableAllocator&) = delete;
+	GrowableAllocator& operator=(const GrowableAllocator&) = delete;
+	void* allocate(size_t numBytes);
+	void* allocate(size_t numBytes, size_t alignment);
+	void deallocate(void* ptr);
+	// Возвращает количество кусков, полученных от ОС
+	size_t chunkCount() const;
+};
\ No newline at end of file
@@ -1,249 +1,1845 @@
 ﻿#include "myfs.h"
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Читает 8-байтное число, записанное от младшего байта к старшему
+static size_t loadLong(const char* bytes)
+{
+	size_t result = 0;
+	for (size_t i = 0; i < 8; ++i)
+	{
+		result |= size_t(static_cast<unsigned char>(bytes[i])) << (i * 8);
+	}
+	return result;
+}
+
+// Записывает 8-байтное число от младшего байта к старшему
+static void storeLong(char* bytes, size_t num)
+{
+	for (size_t i = 0; i < 8; ++i)
+	{
+		bytes[i] = char(num >> (i * 8));
+	}
+}
+
+// Читает 4-байтное число, записанное от младшего байта к старшему
+static size_t loadInt(const char* bytes)
+{
+	size_t result = 0;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		result |= size_t(static_cast<unsigned char>(bytes[i])) << (i * 8);
+	}
+	return result;
+}
+
+// Записывает 4-байтное число от младшего байта к старшему
+static void storeInt(char* bytes, size_t num)
+{
+	for (size_t i = 0; i < 4; ++i)
+	{
+		bytes[i] = char(num >> (i * 8));
+	}
+}
+
+// Контрольная сумма count 8-байтных чисел
+static size_t journalChecksum(const char* words, size_t count)
+{
+	size_t hash = 0xCBF29CE484222325;
+	for (size_t i = 0; i < count; ++i)
+	{
+		hash = (hash ^ loadLong(words + i * 8)) * 0x100000001B3;
+	}
+	return hash;
+}
+
+// Номер младшего единичного бита ненулевого числа
+static size_t lowestBit(unsigned long long mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return index;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+// Зависит ли результат обращений от порядка их выполнения: диапазоны пересекаются и хотя бы одно из обращений - запись
+static bool ioConflict(const IoRequest& a, const IoRequest& b)
+{
+	return (a.write_ || b.write_) && a.pos_ < b.pos_ + b.count_ && b.pos_ < a.pos_ + a.count_;
+}
+
+MyFileSystem::FileList::FileList()
+{
+	fileCount_ = 0;
+	openCount_ = 0;
+	maxFileCount_ = npos;
+}
+
+size_t MyFileSystem::FileList::hash_(const std::string& name)
+{
+	size_t hash = 0xCBF29CE484222325;
+	for (size_t i = 0; i < name.size(); ++i)
+	{
+		hash = (hash ^ static_cast<unsigned char>(name[i])) * 0x100000001B3;
+	}
+	return hash;
+}
+
+size_t MyFileSystem::FileList::findSlot_(size_t record) const
+{
+	size_t mask = slots_.size() - 1;
+	size_t slot = records_[record].hash_ & mask;
+	while (slots_[slot] != record + 1)
+	{
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+void MyFileSystem::FileList::insertSlot_(size_t record)
+{
+	if ((fileCount_ + 1) * 2 > slots_.size())
+	{
+		std::vector<size_t> old(slots_.size() ? slots_.size() * 2 : 16, 0);
+		old.swap(slots_);
+		for (size_t i = 0; i < old.size(); ++i)
+		{
+			if (old[i])
+			{
+				size_t slot = records_[old[i] - 1].hash_ & (slots_.size() - 1);
+				while (slots_[slot])
+				{
+					slot = (slot + 1) & (slots_.size() - 1);
+				}
+				slots_[slot] = old[i];
+			}
+		}
+	}
+	size_t mask = slots_.size() - 1;
+	size_t slot = records_[record].hash_ & mask;
+	while (slots_[slot])
+	{
+		slot = (slot + 1) & mask;
+	}
+	slots_[slot] = record + 1;
+	++fileCount_;
+}
+
+size_t MyFileSystem::FileList::size() const
+{
+	return fileCount_;
+}
+
+size_t MyFileSystem::FileList::recordCount() const
+{
+	return records_.size();
+}
+
+bool MyFileSystem::FileList::hasFreeRecord() const
+{
+	return !freeRecords_.empty();
+}
+
+bool MyFileSystem::FileList::used(size_t record) const
+{
+	return !records_[record].name_.empty();
+}
+
+const std::string& MyFileSystem::FileList::name(size_t record) const
+{
+	return records_[record].name_;
+}
+
+MyFileSystem::FileList::fileNote& MyFileSystem::FileList::note(size_t record)
+{
+	return records_[record].note_;
+}
+
+const MyFileSystem::FileList::fileNote& MyFileSystem::FileList::note(size_t record) const
+{
+	return records_[record].note_;
+}
+
+size_t MyFileSystem::FileList::find(const std::string& name) const
+{
+	if (slots_.empty())
+	{
+		return npos;
+	}
+	size_t hash = hash_(name), mask = slots_.size() - 1;
+	for (size_t slot = hash & mask; slots_[slot]; slot = (slot + 1) & mask)
+	{
+		const directoryEntry& entry = records_[slots_[slot] - 1];
+		if (entry.hash_ == hash && entry.name_ == name)
+		{
+			return slots_[slot] - 1;
+		}
+	}
+	return npos;
+}
+
+size_t MyFileSystem::FileList::insert(const std::string& name, const fileNote& note)
+{
+	if (freeRecords_.empty())
+	{
+		return append(name, note);
+	}
+	size_t record = freeRecords_.back();
+	freeRecords_.pop_back();
+	directoryEntry& entry = records_[record];
+	entry.name_ = name;
+	entry.hash_ = hash_(name);
+	entry.note_ = note;
+	insertSlot_(record);
+	return record;
+}
+
+size_t MyFileSystem::FileList::append(const std::string& name, const fileNote& note)
+{
+	directoryEntry entry = { name, hash_(name), note };
+	records_.push_back(entry);
+	size_t record = records_.size() - 1;
+	if (name.empty())
+	{
+		freeRecords_.push_back(record);
+	}
+	else
+	{
+		insertSlot_(record);
+	}
+	return record;
+}
+
+void MyFileSystem::FileList::erase(size_t record)
+{
+	// Ячейки за удаленной сдвигаются назад, чтобы цепочки пробирования не прерывались
+	size_t mask = slots_.size() - 1;
+	size_t slot = findSlot_(record);
+	for (size_t next = (slot + 1) & mask; slots_[next]; next = (next + 1) & mask)
+	{
+		size_t home = records_[slots_[next] - 1].hash_ & mask;
+		if (((next - home) & mask) >= ((next - slot) & mask))
+		{
+			slots_[slot] = slots_[next];
+			slot = next;
+		}
+	}
+	slots_[slot] = 0;
+	--fileCount_;
+	records_[record].name_.clear();
+	records_[record].note_ = fileNote();
+	freeRecords_.push_back(record);
+}
+
+int MyFileSystem::FileList::openDescriptor(size_t record)
+{
+	int fd;
+	if (!freeDescriptors_.empty())
+	{
+		fd = freeDescriptors_.back();
+		freeDescriptors_.pop_back();
+	}
+	else
+	{
+		if (descriptors_.size() >= size_t(INT_MAX))
+		{
+			throw std::exception("Too many open files");
+		}
+		descriptors_.emplace_back();
+		fd = int(descriptors_.size());
+	}
+	descriptors_[fd - 1].reset(new activeFileNote);
+	activeFileNote& note = *descriptors_[fd - 1];
+	note.record_ = record;
+	note.file_ = &records_[record].note_;
+	note.readPointer_ = 0;
+	++openCount_;
+	return fd;
+}
+
+MyFileSystem::FileList::activeFileNote* MyFileSystem::FileList::descriptor(int fd)
+{
+	return fd > 0 && size_t(fd) <= descriptors_.size() ? descriptors_[fd - 1].get() : nullptr;
+}
+
+const MyFileSystem::FileList::activeFileNote* MyFileSystem::FileList::descriptor(int fd) const
+{
+	return fd > 0 && size_t(fd) <= descriptors_.size() ? descriptors_[fd - 1].get() : nullptr;
+}
+
+void MyFileSystem::FileList::closeDescriptor(int fd)
+{
+	descriptors_[fd - 1].reset();
+	freeDescriptors_.push_back(fd);
+	--openCount_;
+}
+
+size_t MyFileSystem::FileList::openCount() const
+{
+	return openCount_;
+}
+
+int MyFileSystem::FileList::descriptorLimit() const
+{
+	return int(descriptors_.size());
+}
+
+bool MyFileSystem::FreeBlockIndex::findInLevel_(size_t level, size_t from, size_t& result) const
+{
+	const std::vector<unsigned long long>& words = levels_[level];
+	size_t word = from / 64;
+	if (word >= words.size())
+	{
+		return false;
+	}
+	unsigned long long mask = words[word] & (~0ull << (from % 64));
+	if (!mask) // В текущем слове единиц нет - следующее непустое слово ищется по уровню выше
+	{
+		if (level + 1 < levelCount_)
+		{
+			if (!findInLevel_(level + 1, word + 1, word))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			do
+			{
+				if (++word == words.size())
+				{
+					return false;
+				}
+			} while (!words[word]);
+		}
+		mask = words[word];
+	}
+	result = word * 64 + lowestBit(mask);
+	return true;
+}
+
+void MyFileSystem::BitMap::reset(size_t count, bool compact)
+{
+	compact_ = compact;
+	compactNotes_.assign(compact ? count : 0, 0);
+	notes_.assign(compact ? 0 : count, 0);
+}
+
+size_t MyFileSystem::BitMap::operator[](size_t index) const
+{
+	return compact_ ? compactNotes_[index] : notes_[index];
+}
+
+void MyFileSystem::BitMap::set(size_t index, size_t value)
+{
+	if (compact_)
+	{
+		compactNotes_[index] = std::uint32_t(value);
+	}
+	else
+	{
+		notes_[index] = value;
+	}
+}
+
+void MyFileSystem::FreeBlockIndex::build(const BitMap& bitMap, size_t begin, size_t count)
+{
+	size_t bitCount = count;
+	for (size_t level = 0; level < levelCount_; ++level)
+	{
+		levels_[level].assign((bitCount + 63) / 64, 0);
+		bitCount = levels_[level].size();
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!bitMap[begin + i])
+		{
+			levels_[0][i / 64] |= 1ull << (i % 64);
+		}
+	}
+	for (size_t level = 1; level < levelCount_; ++level)
+	{
+		for (size_t i = 0; i < levels_[level - 1].size(); ++i)
+		{
+			if (levels_[level - 1][i])
+			{
+				levels_[level][i / 64] |= 1ull << (i % 64);
+			}
+		}
+	}
+}
+
+void MyFileSystem::FreeBlockIndex::set(size_t index, bool isFree)
+{
+	if (((levels_[0][index / 64] >> (index % 64)) & 1) == isFree)
+	{
+		return;
+	}
+	for (size_t level = 0; level < levelCount_; ++level)
+	{
+		unsigned long long& word = levels_[level][index / 64];
+		bool wasEmpty = !word;
+		if (isFree)
+		{
+			word |= 1ull << (index % 64);
+		}
+		else
+		{
+			word &= ~(1ull << (index % 64));
+		}
+		if (wasEmpty == !word) // Пустота слова не изменилась - верхние уровни остаются прежними
+		{
+			break;
+		}
+		index /= 64;
+	}
+}
+
+bool MyFileSystem::FreeBlockIndex::find(size_t from, size_t& resultIndex) const
+{
+	return findInLevel_(0, from, resultIndex);
+}
+
+size_t MyFileSystem::FreeBlockIndex::runLength(size_t index, size_t maxLength) const
+{
+	size_t length = 0;
+	while (length < maxLength && (index + length) / 64 < levels_[0].size())
+	{
+		size_t pos = index + length;
+		unsigned long long busy = ~levels_[0][pos / 64] >> (pos % 64);
+		if (busy)
+		{
+			length += lowestBit(busy);
+			break;
+		}
+		length += 64 - pos % 64;
+	}
+	return length < maxLength ? length : maxLength;
+}
+
+void MyFileSystem::BlockCache::reset(IoEngine* io, size_t blockSize, size_t capacity)
+{
+	io_ = io;
+	blockSize_ = blockSize;
+	data_.assign(capacity * blockSize, '\0');
+	frame empty = { 0, false, false, false };
+	frames_.assign(capacity, empty);
+	frameOf_.clear();
+	hand_ = 0;
+}
+
+size_t MyFileSystem::BlockCache::capacity() const
+{
+	return frames_.size();
+}
+
+bool MyFileSystem::BlockCache::contains(size_t block) const
+{
+	return frameOf_.find(block) != frameOf_.end();
+}
+
+char* MyFileSystem::BlockCache::find(size_t block, bool forWrite)
+{
+	auto it = frameOf_.find(block);
+	if (it == frameOf_.end())
+	{
+		return nullptr;
+	}
+	frames_[it->second].referenced_ = true;
+	frames_[it->second].dirty_ = frames_[it->second].dirty_ || forWrite;
+	return &data_[it->second * blockSize_];
+}
+
+char* MyFileSystem::BlockCache::insert(size_t block, bool forWrite)
+{
+	while (frames_[hand_].used_ && frames_[hand_].referenced_) // Блоки, к которым обращались после прошлого прохода стрелки, получают еще один шанс
+	{
+		frames_[hand_].referenced_ = false;
+		hand_ = (hand_ + 1) % frames_.size();
+	}
+	size_t index = hand_;
+	hand_ = (hand_ + 1) % frames_.size();
+	if (frames_[index].used_)
+	{
+		if (frames_[index].dirty_)
+		{
+			flush(); // Вытесняемый блок изменен - все измененные блоки записываются одним проходом
+		}
+		frameOf_.erase(frames_[index].block_);
+	}
+	frame victim = { block, true, false, forWrite };
+	frames_[index] = victim;
+	frameOf_[block] = index;
+	return &data_[index * blockSize_];
+}
+
+void MyFileSystem::BlockCache::discard(size_t block)
+{
+	auto it = frameOf_.find(block);
+	if (it != frameOf_.end())
+	{
+		frames_[it->second].used_ = false;
+		frames_[it->second].dirty_ = false;
+		frameOf_.erase(it);
+	}
+}
+
+void MyFileSystem::BlockCache::flush()
+{
+	std::vector<size_t> dirty;
+	for (size_t i = 0; i < frames_.size(); ++i)
+	{
+		if (frames_[i].dirty_)
+		{
+			dirty.push_back(i);
+		}
+	}
+	std::sort(dirty.begin(), dirty.end(), [this](size_t a, size_t b) { return frames_[a].block_ < frames_[b].block_; });
+	std::vector<char> buffer;
+	for (size_t i = 0, j; i < dirty.size(); i = j)
+	{
+		for (j = i + 1; j < dirty.size() && frames_[dirty[j]].block_ == frames_[dirty[j - 1]].block_ + 1; ++j)
+		{
+		}
+		if (j == i + 1)
+		{
+			io_->write(frames_[dirty[i]].block_ * blockSize_, &data_[dirty[i] * blockSize_], blockSize_);
+			frames_[dirty[i]].dirty_ = false;
+			continue;
+		}
+		buffer.resize((j - i) * blockSize_);
+		for (size_t k = i; k < j; ++k)
+		{
+			std::memcpy(&buffer[(k - i) * blockSize_], &data_[dirty[k] * blockSize_], blockSize_);
+		}
+		io_->write(frames_[dirty[i]].block_ * blockSize_, buffer.data(), buffer.size());
+		for (size_t k = i; k < j; ++k) // Признак снимается только после записи, чтобы при ошибке блоки не были вытеснены без записи
+		{
+			frames_[dirty[k]].dirty_ = false;
+		}
+	}
+}
 
 bool MyFileSystem::isPowerOfTwo_(size_t num)
 {
-	if (!num)
+	if (!num)
+	{
+		return false;
+	}
+	while (!(num % 2))
+	{
+		num >>= 1;
+	}
+	return num == 1;
+}
+
+size_t MyFileSystem::strToLong_(const char* str)
+{
+	size_t length = std::strlen(str);
+	size_t bitShift = 0;
+	if (str[length - 1] == 'K' || str[length - 1] == 'M')
+	{
+		bitShift = str[length - 1] == 'K' ? 10 : 20;
+		--length;
+	}
+	size_t result = 0, mult = 1;
+	for (size_t i = length; i--;)
+	{
+		if (str[i] < '0' || str[i] > '9')
+		{
+			throw std::exception("Wrong string format");
+		}
+		result += (str[i] - '0') * mult;
+		mult *= 10;
+	}
+	if (!isPowerOfTwo_(result))
+	{
+		throw std::exception("Wrong size format");
+	}
+	return result << bitShift;
+}
+
+size_t MyFileSystem::readLong_(size_t pos)
+{
+	char bytes[8];
+	io_->read(pos, bytes, 8);
+	return loadLong(bytes);
+}
+
+void MyFileSystem::writeLong_(size_t num, size_t pos)
+{
+	char bytes[8];
+	storeLong(bytes, num);
+	io_->write(pos, bytes, 8);
+}
+
+void MyFileSystem::rewriteBitNote_(size_t num, size_t index)
+{
+	if (!bitMap_[index] != !num)
+	{
+		AllocationShard& shard = *shards_[index / shardBlocks_];
+		std::lock_guard<std::mutex> lock(shard.mutex_);
+		num ? --freeBlockCount_ : ++freeBlockCount_;
+		if (shard.freeIndexBuilt_)
+		{
+			shard.freeIndex_.set(index - shard.begin_, !num);
+		}
+	}
+	bitMap_.set(index, num);
+	markBitNotesDirty_(index, 1);
+}
+
+void MyFileSystem::markBitNotesDirty_(size_t index, size_t count)
+{
+	if (journalBytes_)
+	{
+		markBitMapPages_(index, count);
+		logBitNotes_(index, count);
+		return;
+	}
+	if (writeThrough_)
+	{
+		writeBitNotes_(index, count);
+		return;
+	}
+	if (!dirtyBitMapPageCount_ && !fileListDirty_)
+	{
+		dirtySince_ = std::chrono::steady_clock::now();
+	}
+	markBitMapPages_(index, count);
+	flushIfNeeded_();
+}
+
+void MyFileSystem::markBitMapPages_(size_t index, size_t count)
+{
+	const size_t notesPerPage = bitMapPageSize / bitNoteBytes_();
+	for (size_t page = index / notesPerPage; page <= (index + count - 1) / notesPerPage; ++page)
+	{
+		unsigned long long bit = 1ull << (page % 64);
+		if (!(dirtyBitMapPages_[page / 64] & bit))
+		{
+			dirtyBitMapPages_[page / 64] |= bit;
+			++dirtyBitMapPageCount_;
+		}
+	}
+}
+
+void MyFileSystem::markDirectoryRecord_(size_t record)
+{
+	if (formatVersion_ < blockDirectoryVersion)
+	{
+		return;
+	}
+	size_t block = record / (blockSize_ / extendedFileNoteSize);
+	if (block >= directoryBlockDirty_.size())
+	{
+		directoryBlockDirty_.resize(block + 1);
+	}
+	directoryBlockDirty_[block] = true;
+}
+
+void MyFileSystem::markFileListDirty_(size_t record)
+{
+	markDirectoryRecord_(record);
+	if (journalBytes_)
+	{
+		fileListDirty_ = true;
+		return;
+	}
+	if (writeThrough_)
+	{
+		overWriteFileService_();
+		return;
+	}
+	if (!dirtyBitMapPageCount_ && !fileListDirty_)
+	{
+		dirtySince_ = std::chrono::steady_clock::now();
+	}
+	fileListDirty_ = true;
+	flushIfNeeded_();
+}
+
+void MyFileSystem::beginJournalRecord_(size_t type, size_t count)
+{
+	if (journalPending_.empty())
+	{
+		dirtySince_ = std::chrono::steady_clock::now();
+	}
+	journalLastRecord_ = journalPending_.size();
+	journalPending_.push_back(type | count << 8);
+}
+
+void MyFileSystem::logBitNotes_(size_t index, size_t count)
+{
+	bool zero = true, chain = count > 1;
+	for (size_t i = index; i < index + count; ++i)
+	{
+		zero = zero && !bitMap_[i];
+		chain = chain && bitMap_[i] == (i + 1 < index + count ? blocksForService_ + i + 1 : 1);
+	}
+	size_t type = zero ? journalZeroNotes_ : chain ? journalChainNotes_ : journalSetNotes_;
+	if (type != journalChainNotes_ && journalLastRecord_ < journalPending_.size()) // Изменение продолжает последнюю запись того же типа - запись удлиняется
+	{
+		size_t& header = journalPending_[journalLastRecord_];
+		if ((header & 0xFF) == type && journalPending_[journalLastRecord_ + 1] + (header >> 8) == index)
+		{
+			header += count << 8;
+			for (size_t i = index; type == journalSetNotes_ && i < index + count; ++i)
+			{
+				journalPending_.push_back(bitMap_[i]);
+			}
+			return;
+		}
+	}
+	beginJournalRecord_(type, count);
+	journalPending_.push_back(index);
+	for (size_t i = index; type == journalSetNotes_ && i < index + count; ++i)
+	{
+		journalPending_.push_back(bitMap_[i]);
+	}
+}
+
+void MyFileSystem::logFileNote_(const std::string& fileName, const FileList::fileNote& note)
+{
+	if (!journalBytes_)
+	{
+		return;
+	}
+	char name[fileNameSize] = {};
+	std::memcpy(name, fileName.data(), fileName.length());
+	size_t nameWords[fileNameSize / 8];
+	for (size_t i = 0; i < fileNameSize / 8; ++i)
+	{
+		nameWords[i] = loadLong(name + i * 8);
+	}
+	size_t fields[] = { note.firstBlock_, note.byteCount_, note.lastBlock_, note.fileBlocks_ };
+	size_t fieldCount = fileNoteBytes_ == extendedFileNoteSize ? 4 : 2; // Последний блок заносится в журнал, только если для него есть место в записи о файле
+	if (journalLastRecord_ < journalPending_.size() && journalPending_[journalLastRecord_] == journalFileNote_
+		&& std::equal(nameWords, nameWords + fileNameSize / 8, journalPending_.begin() + journalLastRecord_ + 1 + fieldCount))
+	{
+		std::copy(fields, fields + fieldCount, journalPending_.begin() + journalLastRecord_ + 1); // Размер того же файла меняется повторно - достаточно обновить последнюю запись
+		return;
+	}
+	beginJournalRecord_(journalFileNote_, 0);
+	journalPending_.insert(journalPending_.end(), fields, fields + fieldCount);
+	journalPending_.insert(journalPending_.end(), nameWords, nameWords + fileNameSize / 8);
+}
+
+void MyFileSystem::logFileDelete_(const std::string& fileName)
+{
+	if (!journalBytes_)
+	{
+		return;
+	}
+	char name[fileNameSize] = {};
+	std::memcpy(name, fileName.data(), fileName.length());
+	beginJournalRecord_(journalFileDelete_, 0);
+	for (size_t i = 0; i < fileNameSize; i += 8)
+	{
+		journalPending_.push_back(loadLong(name + i));
+	}
+}
+
+void MyFileSystem::commitJournal_()
+{
+	if (journalPending_.empty())
+	{
+		return;
+	}
+	completeAsync(); // Данные записываются раньше, чем транзакция, которая на них ссылается
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex_);
+		cache_.flush();
+	}
+	std::vector<char> buffer((journalPending_.size() + 4) * 8);
+	storeLong(&buffer[0], journalMagic);
+	storeLong(&buffer[8], journalSequence_);
+	storeLong(&buffer[16], journalPending_.size());
+	for (size_t i = 0; i < journalPending_.size(); ++i)
+	{
+		storeLong(&buffer[24 + i * 8], journalPending_[i]);
+	}
+	storeLong(&buffer[buffer.size() - 8], journalChecksum(&buffer[8], journalPending_.size() + 2));
+	if (journalTail_ + buffer.size() > journalBytes_)
+	{
+		throw std::exception("Journal transaction does not fit into journal");
+	}
+	io_->write(journalBegin_ + journalTail_, buffer.data(), buffer.size());
+	io_->sync();
+	journalTail_ += buffer.size();
+	++journalSequence_;
+	journalPending_.clear();
+	journalLastRecord_ = 0;
+	if (journalBytes_ - journalTail_ < 2 * journalGroupBytes_)
+	{
+		checkpoint_();
+	}
+}
+
+void MyFileSystem::commitIfFull_()
+{
+	if (journalPending_.size() * 8 >= journalGroupBytes_)
+	{
+		commitJournal_();
+	}
+}
+
+void MyFileSystem::endOperation_()
+{
+	if (!journalPending_.empty() && (writeThrough_ || journalPending_.size() * 8 >= journalGroupBytes_
+		|| std::chrono::steady_clock::now() - dirtySince_ >= std::chrono::milliseconds(metadataFlushIntervalMs)))
+	{
+		commitJournal_();
+	}
+}
+
+void MyFileSystem::checkpoint_()
+{
+	flushMetadata_();
+	io_->sync();
+	journalTail_ = 0;
+	journalBaseSequence_ = journalSequence_;
+	writeSuperBlock_(false);
+	io_->sync();
+}
+
+bool MyFileSystem::replayJournal_()
+{
+	std::vector<char> buffer(journalBytes_);
+	io_->read(journalBegin_, buffer.data(), buffer.size());
+	size_t pos = 0;
+	journalSequence_ = journalBaseSequence_;
+	while (pos + 32 <= journalBytes_)
+	{
+		const char* transaction = buffer.data() + pos;
+		size_t count = loadLong(transaction + 16);
+		if (loadLong(transaction) != journalMagic || loadLong(transaction + 8) != journalSequence_ || count > (journalBytes_ - pos) / 8 - 4
+			|| journalChecksum(transaction + 8, count + 2) != loadLong(transaction + 24 + count * 8))
+		{
+			break; // Дальше транзакции не зафиксированы или остались от прошлых контрольных точек
+		}
+		applyJournalRecords_(transaction + 24, count);
+		pos += (count + 4) * 8;
+		++journalSequence_;
+	}
+	journalTail_ = 0;
+	return journalSequence_ != journalBaseSequence_;
+}
+
+void MyFileSystem::applyJournalRecords_(const char* records, size_t count)
+{
+	const char* end = records + count * 8;
+	while (records != end)
+	{
+		size_t header = loadLong(records);
+		size_t type = header & 0xFF, noteCount = header >> 8;
+		size_t fieldCount = fileNoteBytes_ == extendedFileNoteSize ? 4 : 2;
+		size_t length = type == journalFileNote_ ? 1 + fieldCount + fileNameSize / 8 : type == journalFileDelete_ ? 1 + fileNameSize / 8 : type == journalSetNotes_ ? 2 + noteCount : 2;
+		if (type < journalSetNotes_ || type > journalFileDelete_ || size_t(end - records) / 8 < length)
+		{
+			throw std::exception("Journal is corrupted");
+		}
+		if (type == journalFileNote_)
+		{
+			FileList::fileNote note = { loadLong(records + 8), loadLong(records + 16), 0, 0, nullptr };
+			if (fieldCount == 4)
+			{
+				note.lastBlock_ = loadLong(records + 24);
+				note.fileBlocks_ = loadLong(records + 32);
+			}
+			const char* name = records + 8 + fieldCount * 8;
+			std::string fileName(name, strnlen(name, fileNameSize));
+			size_t record = fileList_.find(fileName);
+			if (record == FileList::npos)
+			{
+				record = fileList_.insert(fileName, note);
+			}
+			else
+			{
+				fileList_.note(record) = note;
+			}
+			markDirectoryRecord_(record);
+			fileListDirty_ = true;
+			if (fileList_.size() > fileList_.maxFileCount_)
+			{
+				throw std::exception("Journal is corrupted");
+			}
+		}
+		else if (type == journalFileDelete_)
+		{
+			size_t record = fileList_.find(std::string(records + 8, strnlen(records + 8, fileNameSize)));
+			if (record != FileList::npos)
+			{
+				fileList_.erase(record);
+				markDirectoryRecord_(record);
+			}
+			fileListDirty_ = true;
+		}
+		else
+		{
+			size_t index = loadLong(records + 8);
+			if (!noteCount || index >= blocksForData_ || noteCount > blocksForData_ - index)
+			{
+				throw std::exception("Journal is corrupted");
+			}
+			for (size_t i = index; i < index + noteCount; ++i)
+			{
+				if (type == journalSetNotes_)
+				{
+					bitMap_.set(i, loadLong(records + 16 + (i - index) * 8));
+				}
+				else if (type == journalZeroNotes_)
+				{
+					bitMap_.set(i, 0);
+				}
+				else
+				{
+					bitMap_.set(i, i + 1 < index + noteCount ? blocksForService_ + i + 1 : 1);
+				}
+			}
+			markBitMapPages_(index, noteCount);
+		}
+		records += length * 8;
+	}
+}
+
+void MyFileSystem::updateFileNote_(size_t record)
+{
+	markDirectoryRecord_(record);
+	fileListDirty_ = true;
+	logFileNote_(fileList_.name(record), fileList_.note(record));
+}
+
+void MyFileSystem::flushIfNeeded_()
+{
+	if (dirtyBitMapPageCount_ >= maxDirtyBitMapPages
+		|| std::chrono::steady_clock::now() - dirtySince_ >= std::chrono::milliseconds(metadataFlushIntervalMs))
+	{
+		flushMetadata_();
+	}
+}
+
+void MyFileSystem::flushMetadata_()
+{
+	completeAsync();
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex_);
+		cache_.flush();
+	}
+	const size_t notesPerPage = bitMapPageSize / bitNoteBytes_();
+	size_t runBegin = 0, runEnd = 0; // Отрезок соседних измененных страниц, еще не записанный в файл
+	for (size_t word = 0; word < dirtyBitMapPages_.size(); ++word)
+	{
+		while (dirtyBitMapPages_[word])
+		{
+			size_t page = word * 64 + lowestBit(dirtyBitMapPages_[word]);
+			dirtyBitMapPages_[word] &= dirtyBitMapPages_[word] - 1;
+			if (page != runEnd)
+			{
+				if (runEnd != runBegin)
+				{
+					writeBitNotes_(runBegin * notesPerPage, (runEnd * notesPerPage < blocksForData_ ? runEnd * notesPerPage : blocksForData_) - runBegin * notesPerPage);
+				}
+				runBegin = page;
+			}
+			runEnd = page + 1;
+		}
+	}
+	if (runEnd != runBegin)
+	{
+		writeBitNotes_(runBegin * notesPerPage, (runEnd * notesPerPage < blocksForData_ ? runEnd * notesPerPage : blocksForData_) - runBegin * notesPerPage);
+	}
+	dirtyBitMapPageCount_ = 0;
+	if (fileListDirty_)
+	{
+		overWriteFileService_();
+		fileListDirty_ = false;
+	}
+}
+
+void MyFileSystem::writeBitNotes_(size_t index, size_t count)
+{
+	size_t noteBytes = bitNoteBytes_();
+	std::vector<char> buffer(count * noteBytes);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (noteBytes == 4)
+		{
+			storeInt(&buffer[i * 4], bitMap_[index + i]);
+		}
+		else
+		{
+			storeLong(&buffer[i * 8], bitMap_[index + i]);
+		}
+	}
+	io_->write(8 + index * noteBytes, buffer.data(), buffer.size());
+}
+
+void MyFileSystem::readBitMap_(const char* buffer)
+{
+	bool compact = bitNoteBytes_() == 4;
+	for (size_t i = 0; i < blocksForData_; ++i)
+	{
+		bitMap_.set(i, compact ? loadInt(buffer + i * 4) : loadLong(buffer + i * 8));
+	}
+}
+
+size_t MyFileSystem::bitNoteBytes_() const
+{
+	return formatVersion_ >= compactBitMapVersion && blockCount_ <= maxCompactBlockCount ? 4 : 8;
+}
+
+void MyFileSystem::writeSuperBlock_(bool clean)
+{
+	if (!hasSuperBlock_)
+	{
+		return;
+	}
+	char buffer[superBlockSize] = {};
+	storeLong(buffer, superBlockMagic);
+	storeLong(buffer + 8, formatVersion_);
+	storeLong(buffer + 16, clean);
+	storeLong(buffer + 24, freeBlockCount_);
+	storeLong(buffer + 32, formatVersion_ >= blockDirectoryVersion ? directoryBlocks_[0] : fileList_.size());
+	storeLong(buffer + 40, allocationCursor_);
+	storeLong(buffer + 48, journalBytes_);
+	storeLong(buffer + 56, journalBaseSequence_);
+	io_->write(superBlockBegin_, buffer, superBlockSize);
+}
+
+void MyFileSystem::initShards_()
+{
+	shardBlocks_ = (blocksForData_ + maxAllocationShards - 1) / maxAllocationShards;
+	shardBlocks_ = shardBlocks_ < minAllocationShardBlocks ? minAllocationShardBlocks : (shardBlocks_ + 63) / 64 * 64;
+	shards_.clear();
+	for (size_t begin = 0; begin < blocksForData_; begin += shardBlocks_)
+	{
+		std::unique_ptr<AllocationShard> shard(new AllocationShard);
+		shard->freeIndexBuilt_ = false;
+		shard->begin_ = begin;
+		shard->count_ = blocksForData_ - begin < shardBlocks_ ? blocksForData_ - begin : shardBlocks_;
+		shard->cursor_ = begin;
+		shards_.push_back(std::move(shard));
+	}
+}
+
+void MyFileSystem::buildFreeIndex_(AllocationShard& shard)
+{
+	if (!shard.freeIndexBuilt_)
+	{
+		std::lock_guard<std::mutex> metadataLock(metadataMutex_);
+		std::lock_guard<std::mutex> lock(shard.mutex_);
+		if (!shard.freeIndexBuilt_)
+		{
+			shard.freeIndex_.build(bitMap_, shard.begin_, shard.count_);
+			shard.freeIndexBuilt_ = true;
+		}
+	}
+}
+
+void MyFileSystem::overwriteBitMap_()
+{
+	writeBitNotes_(0, blocksForData_);
+}
+
+void MyFileSystem::overWriteFileService_()
+{
+	if (formatVersion_ < blockDirectoryVersion)
+	{
+		std::vector<char> buffer(8 + fileList_.size() * fileNoteBytes_, '\0');
+		storeLong(&buffer[0], fileList_.size());
+		char* note = &buffer[8];
+		for (size_t record = 0; record < fileList_.recordCount(); ++record)
+		{
+			if (fileList_.used(record))
+			{
+				storeFileNote_(note, record);
+				note += fileNoteBytes_;
+			}
+		}
+		io_->write(fileServiceBegin_, buffer.data(), buffer.size());
+		return;
+	}
+	size_t recordsPerBlock = blockSize_ / extendedFileNoteSize;
+	std::vector<char> buffer(blockSize_);
+	for (size_t block = 0; block < directoryBlocks_.size() && block < directoryBlockDirty_.size(); ++block)
+	{
+		if (!directoryBlockDirty_[block])
+		{
+			continue;
+		}
+		std::fill(buffer.begin(), buffer.end(), '\0');
+		for (size_t record = block * recordsPerBlock; record < (block + 1) * recordsPerBlock && record < fileList_.recordCount(); ++record)
+		{
+			if (fileList_.used(record))
+			{
+				storeFileNote_(&buffer[(record - block * recordsPerBlock) * extendedFileNoteSize], record);
+			}
+		}
+		io_->write(directoryBlocks_[block] * blockSize_, buffer.data(), buffer.size());
+		directoryBlockDirty_[block] = false;
+	}
+}
+
+void MyFileSystem::storeFileNote_(char* buffer, size_t record)
+{
+	const std::string& name = fileList_.name(record);
+	const FileList::fileNote& note = fileList_.note(record);
+	std::memcpy(buffer, name.data(), name.length());
+	storeLong(buffer + fileNameSize, note.firstBlock_);
+	storeLong(buffer + fileNameSize + 8, note.byteCount_);
+	if (fileNoteBytes_ == extendedFileNoteSize)
+	{
+		storeLong(buffer + fileNameSize + 16, note.lastBlock_);
+		storeLong(buffer + fileNameSize + 24, note.fileBlocks_);
+	}
+}
+
+size_t MyFileSystem::directoryCapacity_() const
+{
+	return directoryBlocks_.size() * (blockSize_ / extendedFileNoteSize);
+}
+
+void MyFileSystem::findDirectoryBlocks_(size_t firstBlock)
+{
+	directoryBlocks_.clear();
+	for (size_t block = firstBlock; ; block = bitMap_[block - blocksForService_])
+	{
+		if (block < blocksForService_ || block >= blockCount_ || directoryBlocks_.size() == blocksForData_)
+		{
+			throw std::exception("Directory is corrupted");
+		}
+		directoryBlocks_.push_back(block);
+		if (bitMap_[block - blocksForService_] == 1)
+		{
+			break;
+		}
+	}
+	if (directoryBlockDirty_.size() < directoryBlocks_.size())
+	{
+		directoryBlockDirty_.resize(directoryBlocks_.size());
+	}
+}
+
+void MyFileSystem::readDirectory_(size_t firstBlock)
+{
+	findDirectoryBlocks_(firstBlock);
+	std::vector<char> buffer;
+	for (size_t i = 0, j; i < directoryBlocks_.size(); i = j)
+	{
+		for (j = i + 1; j < directoryBlocks_.size() && directoryBlocks_[j] == directoryBlocks_[j - 1] + 1; ++j) // Соседние блоки каталога читаются одним обращением
+		{
+		}
+		buffer.resize((j - i) * blockSize_);
+		io_->read(directoryBlocks_[i] * blockSize_, buffer.data(), buffer.size());
+		for (const char* note = buffer.data(); note != buffer.data() + buffer.size(); note += extendedFileNoteSize)
+		{
+			FileList::fileNote fileNote = { loadLong(note + fileNameSize), loadLong(note + fileNameSize + 8),
+				loadLong(note + fileNameSize + 16), loadLong(note + fileNameSize + 24), nullptr };
+			fileList_.append(std::string(note, strnlen(note, fileNameSize)), fileNote);
+		}
+	}
+}
+
+bool MyFileSystem::linkDirectoryBlock_()
+{
+	size_t index, length;
+	if (!allocateRun_(index, length, directoryBlocks_.empty() ? blocksForData_ : directoryBlocks_.back() - blocksForService_ + 1, 1))
 	{
 		return false;
 	}
-	while (!(num % 2))
+	std::vector<char> buffer(blockSize_, '\0');
+	io_->write((blocksForService_ + index) * blockSize_, buffer.data(), buffer.size()); // Блок очищается до присоединения, чтобы в каталог не попали старые данные
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	if (directoryBlocks_.empty())
 	{
-		num >>= 1;
+		bitMap_.set(index, 1);
+		markBitNotesDirty_(index, 1);
 	}
-	return num == 1;
+	else
+	{
+		linkRun_(directoryBlocks_.back() - blocksForService_, index, 1);
+	}
+	directoryBlocks_.push_back(blocksForService_ + index);
+	if (directoryBlockDirty_.size() < directoryBlocks_.size())
+	{
+		directoryBlockDirty_.resize(directoryBlocks_.size());
+	}
+	return true;
 }
 
-size_t MyFileSystem::strToLong_(const char* str)
+void MyFileSystem::migrateDirectory_()
 {
-	size_t length = std::strlen(str);
-	size_t bitShift = 0;
-	if (str[length - 1] == 'K' || str[length - 1] == 'M')
+	size_t blocks = fileList_.recordCount() / (blockSize_ / extendedFileNoteSize) + 1;
+	if (freeBlockCount_ < blocks)
 	{
-		bitShift = str[length - 1] == 'K' ? 10 : 20;
-		--length;
+		return; // Места под каталог нет - система остается в прежнем формате
 	}
-	size_t result = 0, mult = 1;
-	for (size_t i = length; i--;)
+	for (size_t i = 0; i < blocks; ++i)
 	{
-		if (str[i] < '0' || str[i] > '9')
+		linkDirectoryBlock_();
+	}
+	if (fileNoteBytes_ != extendedFileNoteSize)
+	{
+		for (size_t record = 0; record < fileList_.recordCount(); ++record) // Записи переписываются целиком, поэтому заодно сохраняются последние блоки файлов
 		{
-			throw std::exception("Wrong string format");
+			if (fileList_.used(record))
+			{
+				FileList::fileNote& note = fileList_.note(record);
+				note.lastBlock_ = getLastBlock_(note.firstBlock_, note.fileBlocks_);
+			}
 		}
-		result += (str[i] - '0') * mult;
-		mult *= 10;
+		fileNoteBytes_ = extendedFileNoteSize;
 	}
-	if (!isPowerOfTwo_(result))
+	formatVersion_ = blockDirectoryVersion; // Ширина элементов битмапа определяет расположение служебной информации, поэтому система не переводится в версию 5
+	fileList_.maxFileCount_ = FileList::npos;
+	directoryBlockDirty_.assign(directoryBlocks_.size(), true);
+	fileListDirty_ = true;
+	// Суперблок с новой версией записывается последним: до этого система остается корректной системой прежней версии
+	if (journalBytes_)
 	{
-		throw std::exception("Wrong size format");
+		commitJournal_();
+		checkpoint_();
+	}
+	else
+	{
+		flushMetadata_();
+		io_->sync();
+		writeSuperBlock_(false);
+		io_->sync();
 	}
-	return result << bitShift;
 }
 
-size_t MyFileSystem::readLong_()
+void MyFileSystem::initServiceInfo_()
 {
-	int ch;
-	size_t result = 0;
-	for (size_t i = 0; i < 8; ++i)
+	blocksForData_ = blockCount_ - blocksForService_;
+	bitMap_.reset(blocksForData_, bitNoteBytes_() == 4);
+	dirtyBitMapPages_.assign((blocksForData_ * bitNoteBytes_() + bitMapPageSize * 64 - 1) / (bitMapPageSize * 64), 0);
+	dirtyBitMapPageCount_ = 0;
+	fileListDirty_ = false;
+	fileServiceBegin_ = 8 + blocksForData_ * bitNoteBytes_();
+	superBlockBegin_ = blocksForService_ * blockSize_ - superBlockSize;
+	initShards_();
+	initJournalInfo_();
+}
+
+void MyFileSystem::initJournalInfo_()
+{
+	journalBegin_ = superBlockBegin_ - journalBytes_;
+	journalGroupBytes_ = journalBytes_ / 4 < journalGroupSize ? journalBytes_ / 4 : journalGroupSize;
+	fileList_.maxFileCount_ = (journalBegin_ - fileServiceBegin_ - 8) / fileNoteBytes_;
+}
+
+void MyFileSystem::createService_()
+{
+	formatVersion_ = fileSystemVersion;
+	size_t minBytesForService = 8 + blockCount_ * bitNoteBytes_() + minBytesForFileService;
+	blocksForService_ = minBytesForService / blockSize_ + 2;
+	if (blockCount_ / blocksForService_ < minServiceNAllBlocksDifference)
+	{
+		throw std::exception("Too many block for service purposes");
+	}
+	if (blockCount_ / blocksForService_ > optimalServiceNAllBlocksDifference)
+	{
+		blocksForService_ = blockCount_ / optimalServiceNAllBlocksDifference + 1;
+		// Записи о файлах хранятся в каталоге, поэтому служебным блокам достаточно места под битмап, минимальный список файлов и наибольший журнал
+		size_t sufficientBlocks = (minBytesForService + 2 * maxJournalSize + superBlockSize) / blockSize_ + 2;
+		blocksForService_ = sufficientBlocks < blocksForService_ ? sufficientBlocks : blocksForService_;
+	}
+	fileNoteBytes_ = extendedFileNoteSize;
+	initServiceInfo_();
+	// Под журнал отводится половина места, оставшегося после минимального списка файлов
+	size_t spareBytes = superBlockBegin_ - fileServiceBegin_ > minBytesForFileService ? superBlockBegin_ - fileServiceBegin_ - minBytesForFileService : 0;
+	journalBytes_ = (spareBytes / 2 < maxJournalSize ? spareBytes / 2 : maxJournalSize) / 8 * 8;
+	if (journalBytes_ < minJournalSize)
+	{
+		journalBytes_ = 0;
+	}
+	initJournalInfo_();
+	fileList_.maxFileCount_ = FileList::npos;
+	journalBaseSequence_ = journalSequence_ = 1;
+	writeLong_(blocksForService_, 0);
+	freeBlockCount_ = blocksForData_;
+	allocationCursor_ = 0;
+	linkDirectoryBlock_();
+	writeLong_(0, fileServiceBegin_);
+	overwriteBitMap_();
+	hasSuperBlock_ = true;
+	writeSuperBlock_(false);
+}
+
+void MyFileSystem::readService_()
+{
+	blocksForService_ = readLong_(0);
+	if (blocksForService_ < 2 || blocksForService_ >= blockCount_)
+	{
+		throw std::exception("File system service info is corrupted");
+	}
+	// Суперблок читается раньше остальной служебной информации: от версии зависит ширина элементов битмапа
+	char superBlock[superBlockSize];
+	io_->read(blocksForService_ * blockSize_ - superBlockSize, superBlock, superBlockSize);
+	hasSuperBlock_ = loadLong(superBlock) == superBlockMagic;
+	formatVersion_ = hasSuperBlock_ ? loadLong(superBlock + 8) : 1;
+	if (formatVersion_ > fileSystemVersion)
+	{
+		throw std::exception("Unsupported file system version");
+	}
+	initServiceInfo_();
+	journalBaseSequence_ = journalSequence_ = 0;
+	bool clean = false;
+	size_t fileCount = 0, directoryBlock = 0;
+	allocationCursor_ = 0;
+	if (hasSuperBlock_)
+	{
+		fileNoteBytes_ = formatVersion_ >= 3 ? extendedFileNoteSize : fileNoteSize;
+		if (formatVersion_ >= 2)
+		{
+			journalBytes_ = loadLong(superBlock + 48);
+			journalBaseSequence_ = loadLong(superBlock + 56);
+			if (journalBytes_ % 8 || journalBytes_ > superBlockBegin_ - fileServiceBegin_ - 8)
+			{
+				throw std::exception("Super block is corrupted");
+			}
+			initJournalInfo_();
+		}
+		clean = loadLong(superBlock + 16) != 0;
+		freeBlockCount_ = loadLong(superBlock + 24);
+		(formatVersion_ >= blockDirectoryVersion ? directoryBlock : fileCount) = loadLong(superBlock + 32);
+		allocationCursor_ = loadLong(superBlock + 40);
+		if (formatVersion_ >= blockDirectoryVersion)
+		{
+			fileList_.maxFileCount_ = FileList::npos;
+		}
+		if (fileCount > fileList_.maxFileCount_ || freeBlockCount_ > blocksForData_ || allocationCursor_ > blocksForData_)
+		{
+			throw std::exception("Super block is corrupted");
+		}
+		if (allocationCursor_ < blocksForData_)
+		{
+			shards_[allocationCursor_ / shardBlocks_]->cursor_ = allocationCursor_;
+		}
+	}
+	// Битмап, количество файлов и записи о файлах читаются одним обращением
+	std::vector<char> buffer(fileServiceBegin_ + fileCount * fileNoteBytes_);
+	io_->read(8, buffer.data(), buffer.size());
+	readBitMap_(buffer.data());
+	const char* notes = buffer.data() + fileServiceBegin_;
+	if (!hasSuperBlock_ || (formatVersion_ < blockDirectoryVersion && loadLong(notes - 8) != fileCount)) // Суперблока нет или система не была корректно отключена - записи дочитываются отдельно
 	{
-		if ((ch = mainFile_.get()) == EOF)
+		fileCount = loadLong(notes - 8);
+		if (fileCount > fileList_.maxFileCount_)
+		{
+			if (hasSuperBlock_ || fileCount > (superBlockBegin_ + superBlockSize - fileServiceBegin_ - 8) / fileNoteSize)
+			{
+				throw std::exception("File list is corrupted");
+			}
+			fileList_.maxFileCount_ = fileCount; // Записи о файлах старой системы занимают место суперблока - система остается без него
+		}
+		else
 		{
-			throw std::exception("Trying to read long after the end of the file");
+			hasSuperBlock_ = true;
 		}
-		result |= (ch << (i * 8));
+		clean = false;
+		buffer.resize(fileCount * fileNoteBytes_);
+		io_->read(fileServiceBegin_ + 8, buffer.data(), buffer.size());
+		notes = buffer.data();
+	}
+	for (const char* note = notes; note != notes + fileCount * fileNoteBytes_; note += fileNoteBytes_)
+	{
+		FileList::fileNote fileNote;
+		fileNote.firstBlock_ = loadLong(note + fileNameSize);
+		fileNote.byteCount_ = loadLong(note + fileNameSize + 8);
+		fileNote.lastBlock_ = fileNoteBytes_ == extendedFileNoteSize ? loadLong(note + fileNameSize + 16) : 0;
+		fileNote.fileBlocks_ = fileNoteBytes_ == extendedFileNoteSize ? loadLong(note + fileNameSize + 24) : 0;
+		fileList_.append(std::string(note, strnlen(note, fileNameSize)), fileNote);
+	}
+	if (formatVersion_ >= blockDirectoryVersion)
+	{
+		readDirectory_(directoryBlock);
+	}
+	bool replayed = journalBytes_ && replayJournal_();
+	if (replayed && formatVersion_ >= blockDirectoryVersion)
+	{
+		findDirectoryBlocks_(directoryBlock); // Журнал мог дописать к каталогу блоки
+		if (fileList_.recordCount() > directoryCapacity_())
+		{
+			throw std::exception("Journal is corrupted");
+		}
+	}
+	if (!clean || replayed)
+	{
+		freeBlockCount_ = 0;
+		for (size_t i = 0; i < blocksForData_; ++i)
+		{
+			freeBlockCount_ += !bitMap_[i];
+		}
+	}
+	if (replayed)
+	{
+		checkpoint_();
+	}
+	else
+	{
+		writeSuperBlock_(false);
+	}
+	if (hasSuperBlock_ && formatVersion_ < blockDirectoryVersion)
+	{
+		migrateDirectory_();
 	}
-	return result;
 }
 
-size_t MyFileSystem::readLong_(size_t pos)
+size_t MyFileSystem::getLastBlock_(size_t firstBlock, size_t& fileBlocks) const
+{
+	size_t index = firstBlock - blocksForService_;
+	fileBlocks = 1;
+	while (bitMap_[index] != 1)
+	{
+		if (!bitMap_[index])
+		{
+			throw std::exception("Bitmap is corrupted");
+		}
+		index = bitMap_[index] - blocksForService_;
+		++fileBlocks;
+	}
+	return blocksForService_ + index;
+}
+
+size_t MyFileSystem::threadShard_() const
 {
-	mainFile_.seekg(pos, std::ios::beg);
-	mainFile_.clear();
-	return readLong_();
+	static std::atomic<size_t> threadCounter(0);
+	thread_local size_t slot = threadCounter++;
+	return slot % shards_.size();
 }
 
-void MyFileSystem::writeLong_(size_t num)
+bool MyFileSystem::findFreeRun_(AllocationShard& shard, size_t& resultIndex, size_t& resultLength, size_t startFrom, size_t maxLength)
 {
-	for (size_t i = 0; i < 8; ++i)
+	startFrom = startFrom >= shard.begin_ && startFrom < shard.begin_ + shard.count_ ? startFrom - shard.begin_ : 0;
+	resultLength = 0;
+	size_t index = startFrom, cur;
+	bool wrapped = false;
+	for (size_t probes = 0; probes < maxFreeRunProbes && resultLength < maxLength;)
+	{
+		if (!shard.freeIndex_.find(index, cur) || (wrapped && cur >= startFrom))
+		{
+			if (wrapped)
+			{
+				break;
+			}
+			wrapped = true;
+			index = 0;
+			continue;
+		}
+		size_t length = shard.freeIndex_.runLength(cur, maxLength);
+		if (length > resultLength)
+		{
+			resultIndex = cur;
+			resultLength = length;
+		}
+		index = cur + length;
+		++probes;
+	}
+	if (!resultLength)
 	{
-		mainFile_.put(num >> (i * 8));
+		return false;
 	}
+	resultIndex += shard.begin_;
+	return true;
 }
 
-void MyFileSystem::writeLong_(size_t num, size_t pos)
+bool MyFileSystem::allocateRun_(size_t& resultIndex, size_t& resultLength, size_t startFrom, size_t maxLength)
 {
-	mainFile_.seekp(pos, std::ios::beg);
-	mainFile_.clear();
-	writeLong_(num);
+	size_t firstShard = startFrom < blocksForData_ ? startFrom / shardBlocks_ : threadShard_();
+	for (size_t i = 0; i < shards_.size(); ++i)
+	{
+		AllocationShard& shard = *shards_[(firstShard + i) % shards_.size()];
+		buildFreeIndex_(shard);
+		std::lock_guard<std::mutex> lock(shard.mutex_);
+		if (findFreeRun_(shard, resultIndex, resultLength, i || startFrom >= blocksForData_ ? shard.cursor_ : startFrom, maxLength))
+		{
+			for (size_t j = resultIndex; j < resultIndex + resultLength; ++j)
+			{
+				shard.freeIndex_.set(j - shard.begin_, false);
+			}
+			shard.cursor_ = resultIndex + resultLength;
+			freeBlockCount_ -= resultLength;
+			allocationCursor_ = resultIndex + resultLength < blocksForData_ ? resultIndex + resultLength : 0;
+			return true;
+		}
+	}
+	return false;
 }
 
-void MyFileSystem::rewriteBitNote_(size_t num, size_t index)
+void MyFileSystem::releaseRun_(size_t index, size_t count)
 {
-	bitMap_[index] = num;
-	writeLong_(num, 8 + index * 8);
+	for (size_t i = index; i < index + count; ++i)
+	{
+		AllocationShard& shard = *shards_[i / shardBlocks_];
+		std::lock_guard<std::mutex> lock(shard.mutex_);
+		shard.freeIndex_.set(i - shard.begin_, true);
+		++freeBlockCount_;
+	}
 }
 
-void MyFileSystem::readBitMap_()
+void MyFileSystem::linkRun_(size_t prevIndex, size_t index, size_t count)
 {
-	mainFile_.seekg(8, std::ios::beg);
-	mainFile_.clear();
-	for (size_t i = 0; i < blocksForData_; ++i)
+	for (size_t i = index; i < index + count; ++i)
 	{
-		bitMap_[i] = readLong_();
+		bitMap_.set(i, i + 1 < index + count ? blocksForService_ + i + 1 : 1);
 	}
+	markBitNotesDirty_(index, count);
+	rewriteBitNote_(blocksForService_ + index, prevIndex); // При сквозной записи отрезок присоединяется к файлу только после записи его собственной цепочки
 }
 
-void MyFileSystem::overwriteBitMap_()
+void MyFileSystem::storeData_(size_t pos, const char* buffer, size_t count, bool async)
+{
+	if (!async)
+	{
+		writeData_(pos, buffer, count);
+		return;
+	}
+	updateCached_(pos, buffer, count);
+	IoRequest request = { pos, const_cast<char*>(buffer), count, true };
+	std::lock_guard<std::mutex> lock(asyncMutex_);
+	asyncRequests_.push_back(request);
+}
+
+void MyFileSystem::storeSpans_(size_t pos, const BufferSpan*& spans, size_t& spanOffset, size_t count, bool async)
+{
+	while (count)
+	{
+		size_t chunk = spans->size_ - spanOffset < count ? spans->size_ - spanOffset : count;
+		storeData_(pos, spans->data_ + spanOffset, chunk, async);
+		pos += chunk;
+		count -= chunk;
+		spanOffset += chunk;
+		if (spanOffset == spans->size_)
+		{
+			++spans;
+			spanOffset = 0;
+		}
+	}
+}
+
+void MyFileSystem::updateCached_(size_t pos, const char* buffer, size_t count)
 {
-	mainFile_.seekp(8, std::ios::beg);
-	mainFile_.clear();
-	for (size_t i = 0; i < blocksForData_; ++i)
+	size_t firstBlock = pos / blockSize_, lastBlock = (pos + count - 1) / blockSize_;
+	std::lock_guard<std::mutex> lock(cacheMutex_);
+	for (size_t block = firstBlock; cache_.capacity() && count && block <= lastBlock; ++block)
 	{
-		writeLong_(bitMap_[i]);
+		if (char* data = cache_.find(block, false))
+		{
+			size_t begin = block * blockSize_ > pos ? block * blockSize_ : pos;
+			size_t end = (block + 1) * blockSize_ < pos + count ? (block + 1) * blockSize_ : pos + count;
+			std::memcpy(data + (begin - block * blockSize_), buffer + (begin - pos), end - begin);
+		}
 	}
 }
 
-void MyFileSystem::overWriteFileService_()
+void MyFileSystem::readData_(size_t pos, char* buffer, size_t count)
 {
-	writeLong_(fileList_.staticMap_.size(), fileServiceBegin_);
-	for (auto it = fileList_.staticMap_.begin(); it != fileList_.staticMap_.end(); ++it)
+	if (!count)
 	{
-		for (size_t i = 0; i < fileNameSize; ++i)
+		return;
+	}
+	size_t firstBlock = pos / blockSize_, lastBlock = (pos + count - 1) / blockSize_;
+	std::unique_lock<std::mutex> lock(cacheMutex_);
+	if (!cache_.capacity() || lastBlock - firstBlock >= maxCachedTransferBlocks)
+	{
+		lock.unlock();
+		io_->read(pos, buffer, count);
+		lock.lock();
+		for (size_t block = firstBlock; cache_.capacity() && block <= lastBlock; ++block) // Поверх прочитанного накладываются блоки кэша, которые могут быть еще не записаны
 		{
-			if (i < it->first.length())
+			if (const char* data = cache_.find(block, false))
 			{
-				mainFile_.put(it->first[i]);
+				size_t begin = block * blockSize_ > pos ? block * blockSize_ : pos;
+				size_t end = (block + 1) * blockSize_ < pos + count ? (block + 1) * blockSize_ : pos + count;
+				std::memcpy(buffer + (begin - pos), data + (begin - block * blockSize_), end - begin);
 			}
-			else
+		}
+		return;
+	}
+	std::vector<char> blockBuffer;
+	while (count)
+	{
+		size_t block = pos / blockSize_, offset = pos % blockSize_;
+		size_t chunk = blockSize_ - offset < count ? blockSize_ - offset : count;
+		char* data = cache_.find(block, false);
+		if (!data)
+		{
+			// Промах читается без блокировки кэша, чтобы промахи разных потоков не ждали друг друга
+			lock.unlock();
+			blockBuffer.resize(blockSize_);
+			io_->read(block * blockSize_, blockBuffer.data(), blockSize_);
+			lock.lock();
+			if (!(data = cache_.find(block, false)))
 			{
-				mainFile_.put('\0');
+				data = cache_.insert(block, false);
+				std::memcpy(data, blockBuffer.data(), blockSize_);
 			}
 		}
-		writeLong_(it->second.firstBlock_);
-		writeLong_(it->second.byteCount_);
+		std::memcpy(buffer, data + offset, chunk);
+		pos += chunk;
+		buffer += chunk;
+		count -= chunk;
 	}
 }
 
-void MyFileSystem::initServiceInfo_()
-{
-	blocksForData_ = blockCount_ - blocksForService_;
-	fileServiceBegin_ = 8 + blocksForData_ * 8;
-	fileList_.maxFileCount_ = (blocksForService_ * blockSize_ - fileServiceBegin_ - 8) / fileNoteSize;
-}
-
-void MyFileSystem::createService_()
+void MyFileSystem::writeData_(size_t pos, const char* buffer, size_t count)
 {
-	size_t minBytesForService = 8 + blockCount_ * 8 + minBytesForFileService;
-	blocksForService_ = minBytesForService / blockSize_ + 2;
-	if (blockCount_ / blocksForService_ < minServiceNAllBlocksDifference)
+	if (!count)
 	{
-		throw std::exception("Too many block for service purposes");
+		return;
 	}
-	if (blockCount_ / blocksForService_ > optimalServiceNAllBlocksDifference)
+	size_t firstBlock = pos / blockSize_, lastBlock = (pos + count - 1) / blockSize_;
+	std::unique_lock<std::mutex> lock(cacheMutex_);
+	if (!cache_.capacity() || lastBlock - firstBlock >= maxCachedTransferBlocks)
 	{
-		blocksForService_ = blockCount_ / optimalServiceNAllBlocksDifference + 1;
+		lock.unlock();
+		updateCached_(pos, buffer, count); // Копии в кэше обновляются до записи, чтобы сброс кэша из другого потока не записал поверх данных старый измененный блок
+		io_->write(pos, buffer, count);
+		return;
 	}
-	initServiceInfo_();
-	writeLong_(blocksForService_, 0);
-	bitMap_ = new size_t[blocksForData_];
-	for (size_t i = 0; i < blocksForData_; ++i)
+	while (count)
 	{
-		bitMap_[i] = 0;
+		size_t block = pos / blockSize_, offset = pos % blockSize_;
+		size_t chunk = blockSize_ - offset < count ? blockSize_ - offset : count;
+		char* data = cache_.find(block, true);
+		if (!data)
+		{
+			data = cache_.insert(block, true);
+			if (chunk != blockSize_) // Блок записывается не целиком - остальная его часть читается из файла
+			{
+				io_->read(block * blockSize_, data, blockSize_);
+			}
+		}
+		std::memcpy(data + offset, buffer, chunk);
+		pos += chunk;
+		buffer += chunk;
+		count -= chunk;
 	}
-	writeLong_(0, fileServiceBegin_);
-	overwriteBitMap_();
 }
 
-void MyFileSystem::readService_()
+void MyFileSystem::readAhead_(size_t block)
 {
-	blocksForService_ = readLong_(0);
-	initServiceInfo_();
-	bitMap_ = new size_t[blocksForData_];
-	for (size_t i = 0; i < blocksForData_; ++i)
 	{
-		bitMap_[i] = readLong_();
+		std::lock_guard<std::mutex> lock(cacheMutex_);
+		if (!cache_.capacity())
+		{
+			return;
+		}
 	}
-	size_t fileCount = readLong_();
-	for (size_t i = 0; i < fileCount; ++i)
+	size_t blocks[readAheadBlocks];
+	size_t length = 0;
 	{
-		int ch;
-		std::string fileName;
-		for (size_t j = 0; j < 32; ++j)
+		std::lock_guard<std::mutex> metadataLock(metadataMutex_); // Битмап изменяется другими потоками под блокировкой метаданных, цепочка копируется под ней
+		for (size_t next = bitMap_[block - blocksForService_]; length < readAheadBlocks && next >= 2; ++length)
 		{
-			if ((ch = mainFile_.get()) == EOF)
-			{
-				throw std::exception("Trying to read filename after the end of file");
-			}
-			if (ch != '\0')
+			blocks[length] = next;
+			next = bitMap_[next - blocksForService_];
+		}
+	}
+	size_t count = 0;
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex_);
+		while (count < length && count < cache_.capacity() && !cache_.contains(blocks[count]))
+		{
+			++count;
+		}
+	}
+	std::vector<char> buffer;
+	for (size_t i = 0, j; i < count; i = j)
+	{
+		for (j = i + 1; j < count && blocks[j] == blocks[j - 1] + 1; ++j) // Соседние блоки цепочки читаются одним обращением
+		{
+		}
+		buffer.resize((j - i) * blockSize_);
+		io_->read(blocks[i] * blockSize_, buffer.data(), buffer.size());
+		std::lock_guard<std::mutex> lock(cacheMutex_);
+		for (size_t k = i; k < j; ++k)
+		{
+			if (!cache_.contains(blocks[k])) // Блок мог быть загружен другим потоком, пока шло чтение
 			{
-				fileName.push_back(ch);
+				std::memcpy(cache_.insert(blocks[k], false), &buffer[(k - i) * blockSize_], blockSize_);
 			}
 		}
-		FileList::fileNote note;
-		note.firstBlock_ = readLong_();
-		note.byteCount_ = readLong_();
-		note.isOpened_ = false;
-		fileList_.staticMap_.insert(std::make_pair(fileName, note));
 	}
 }
 
-void MyFileSystem::beforeClosingFile_(const std::map<int, FileList::activeFileNote>::iterator& itAct)
+void MyFileSystem::buildExtents_(FileList::fileNote& note)
 {
-	std::map<std::string, FileList::fileNote>::iterator itStat;
-	if ((itStat = fileList_.staticMap_.find(itAct->second.fileName_)) == fileList_.staticMap_.end())
+	FileList::openFile& file = *note.open_;
+	if (file.extentsBuilt_)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(file.extentsMutex_);
+	if (file.extentsBuilt_)
 	{
-		throw std::exception("Can not match open file by its name");
+		return;
 	}
-	itStat->second.byteCount_ = itAct->second.byteCount_;
-	itStat->second.isOpened_ = false;
+	std::lock_guard<std::mutex> metadataLock(metadataMutex_); // Битмап изменяется другими потоками под блокировкой метаданных
+	size_t fileBlocks;
+	walkChain_(file, note.firstBlock_, fileBlocks);
+	file.extentsBuilt_ = true;
 }
 
-size_t MyFileSystem::getLastBlock_(size_t firstBlock) const
+size_t MyFileSystem::walkChain_(FileList::openFile& file, size_t firstBlock, size_t& fileBlocks)
 {
-	size_t index = firstBlock - blocksForService_;
-	while (bitMap_[index] != 1)
+	file.extents_.clear();
+	size_t block = firstBlock;
+	fileBlocks = 1;
+	while (true)
 	{
-		if (!bitMap_[index])
+		appendExtent_(file, block, 1);
+		size_t next = bitMap_[block - blocksForService_];
+		if (next == 1)
+		{
+			return block;
+		}
+		if (!next || fileBlocks == blocksForData_) // Цепочка длиннее области данных зациклена
 		{
 			throw std::exception("Bitmap is corrupted");
 		}
-		index = bitMap_[index] - blocksForService_;
+		block = next;
+		++fileBlocks;
 	}
-	return blocksForService_ + index;
 }
 
-bool MyFileSystem::findFreeBlockIndex_(size_t& resultIndex, size_t indexToStart) const
+void MyFileSystem::appendExtent_(FileList::openFile& file, size_t block, size_t count)
 {
-	for (size_t i = indexToStart; i < blocksForData_; ++i)
+	if (file.extents_.empty())
 	{
-		if (!bitMap_[i])
-		{
-			resultIndex = i;
-			return true;
-		}
+		FileList::blockExtent extent = { 0, block, count };
+		file.extents_.push_back(extent);
+		return;
 	}
-	return false;
+	FileList::blockExtent& last = file.extents_.back();
+	if (last.block_ + last.count_ == block)
+	{
+		last.count_ += count;
+		return;
+	}
+	FileList::blockExtent extent = { last.fileBlock_ + last.count_, block, count };
+	file.extents_.push_back(extent);
 }
 
-bool MyFileSystem::findFreeBlockIndex_(size_t& resultIndex) const
+size_t MyFileSystem::locateInFile_(FileList::fileNote& note, size_t offset, size_t& contiguousBytes)
 {
-	return findFreeBlockIndex_(resultIndex, 0);
+	buildExtents_(note);
+	const std::vector<FileList::blockExtent>& extents = note.open_->extents_;
+	size_t fileBlock = offset / blockSize_;
+	auto it = std::upper_bound(extents.begin(), extents.end(), fileBlock,
+		[](size_t value, const FileList::blockExtent& extent) { return value < extent.fileBlock_; }) - 1;
+	if (fileBlock >= it->fileBlock_ + it->count_)
+	{
+		throw std::exception("Bitmap is corrupted");
+	}
+	contiguousBytes = (it->fileBlock_ + it->count_) * blockSize_ - offset;
+	return (it->block_ + fileBlock - it->fileBlock_) * blockSize_ + offset % blockSize_;
+}
+
+size_t MyFileSystem::readRange_(FileList::fileNote& note, size_t offset, char* buffer, size_t size)
+{
+	size_t pos = 0;
+	for (size_t done = 0, chunk; done < size; done += chunk)
+	{
+		pos = locateInFile_(note, offset + done, chunk);
+		chunk = chunk < size - done ? chunk : size - done;
+		readData_(pos, buffer + done, chunk);
+		pos += chunk - 1;
+	}
+	return pos / blockSize_;
+}
+
+void MyFileSystem::writeRange_(FileList::fileNote& note, size_t offset, const char* buffer, size_t size)
+{
+	for (size_t done = 0, chunk; done < size; done += chunk)
+	{
+		size_t pos = locateInFile_(note, offset + done, chunk);
+		chunk = chunk < size - done ? chunk : size - done;
+		writeData_(pos, buffer + done, chunk);
+	}
 }
 
-void MyFileSystem::writeToBlockIndex_(size_t index, const char* buffer, size_t count)
+void MyFileSystem::queueRange_(FileList::fileNote& note, size_t offset, char* buffer, size_t size, bool write)
 {
-	mainFile_.seekp((blocksForService_ + index) * blockSize_, std::ios::beg);
-	mainFile_.clear();
-	mainFile_.write(buffer, count);
+	for (size_t done = 0, chunk; done < size; done += chunk)
+	{
+		size_t pos = locateInFile_(note, offset + done, chunk);
+		chunk = chunk < size - done ? chunk : size - done;
+		if (write)
+		{
+			updateCached_(pos, buffer + done, chunk);
+		}
+		IoRequest request = { pos, buffer + done, chunk, write };
+		std::lock_guard<std::mutex> lock(asyncMutex_);
+		asyncRequests_.push_back(request);
+	}
 }
 
-void MyFileSystem::readFromBlock_(size_t block, char* buffer, size_t count)
+int MyFileSystem::appendData_(FileList::activeFileNote& note, const BufferSpan* spans, size_t count, bool async)
 {
-	mainFile_.seekg(block * blockSize_, std::ios::beg);
-	mainFile_.clear();
-	mainFile_.read(buffer, count);
+	FileList::fileNote& file = *note.file_;
+	size_t size = 0, spanOffset = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		size += spans[i].size_;
+	}
+	size_t writeToCurBlock = ((file.byteCount_ % blockSize_) || !file.byteCount_) ? (blockSize_ - (file.byteCount_ % blockSize_)) : 0;
+	if (writeToCurBlock)
+	{
+		size_t pos = file.lastBlock_ * blockSize_ + (file.byteCount_ % blockSize_);
+		size_t toWrite = size < writeToCurBlock ? size : writeToCurBlock;
+		storeSpans_(pos, spans, spanOffset, toWrite, async);
+		std::lock_guard<std::mutex> lock(metadataMutex_);
+		file.byteCount_ += toWrite;
+		updateFileNote_(note.record_);
+		if (size <= writeToCurBlock)
+		{
+			endOperation_();
+			return 0;
+		}
+	}
+	size_t bytesWritten = writeToCurBlock;
+	size_t prevBlockIndex = file.lastBlock_ - blocksForService_;
+	while (bytesWritten < size)
+	{
+		size_t runIndex, runLength;
+		if (!allocateRun_(runIndex, runLength, prevBlockIndex + 1, (size - bytesWritten + blockSize_ - 1) / blockSize_))
+		{
+			break;
+		}
+		size_t toWrite = (size - bytesWritten) < runLength * blockSize_ ? (size - bytesWritten) : runLength * blockSize_;
+		storeSpans_((blocksForService_ + runIndex) * blockSize_, spans, spanOffset, toWrite, async);
+		// Отрезок присоединяется к файлу вместе с изменением размера и последнего блока, чтобы транзакция или контрольная точка посреди записи сохранили согласованные метаданные
+		std::lock_guard<std::mutex> lock(metadataMutex_);
+		linkRun_(prevBlockIndex, runIndex, runLength);
+		if (file.open_->extentsBuilt_)
+		{
+			appendExtent_(*file.open_, blocksForService_ + runIndex, runLength);
+		}
+		bytesWritten += toWrite;
+		prevBlockIndex = runIndex + runLength - 1;
+		file.byteCount_ += toWrite;
+		file.lastBlock_ = blocksForService_ + prevBlockIndex;
+		file.fileBlocks_ += runLength;
+		updateFileNote_(note.record_);
+		commitIfFull_();
+	}
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	endOperation_();
+	return bytesWritten < size ? int(bytesWritten) : 0;
 }
 
-MyFileSystem::MyFileSystem(const char* fileName, const char* fileSize, const char* blockSize)
+MyFileSystem::MyFileSystem(const char* fileName, const char* fileSize, const char* blockSize, IoEngineType ioType)
 {
 	mainFileSize_ = strToLong_(fileSize);
 	blockSize_ = strToLong_(blockSize);
@@ -263,37 +1859,20 @@ MyFileSystem::MyFileSystem(const char* fileName, const char* fileSize, const cha
 	{
 		throw std::exception("Too big block size");
 	}
-	mainFile_.open(fileName);
-	bool fileCreated = false;
-	if (!mainFile_)
-	{
-		std::ofstream outFile(fileName);
-		if (!outFile)
-		{
-			throw std::exception("Can not create file for file system");
-		}
-		outFile.seekp(mainFileSize_ - 1, std::ios::beg);
-		outFile.write("", 1);
-		outFile.close();
-		mainFile_.open(fileName);
-		if (!mainFile_)
-		{
-			throw std::exception("Can not open just created file for file system");
-		}
-		fileCreated = true;
-	}
-	mainFile_.seekg(0, std::ios::end);
-	if (mainFile_.tellg() != mainFileSize_)
+	io_ = IoEngine::open(ioType, fileName, mainFileSize_);
+	if (io_->size() != mainFileSize_)
 	{
-		mainFile_.close();
 		throw std::exception("Given file size does not equal actual file size");
 	}
-	mainFile_.seekg(0, std::ios::beg);
-	mainFile_.clear();
-	mainFile_.seekp(0, std::ios::beg);
 	blockCount_ = mainFileSize_ / blockSize_;
-	fileList_.maxID_ = 0;
-	if (fileCreated)
+	cache_.reset(io_.get(), blockSize_, defaultCacheSize / blockSize_);
+	writeThrough_ = false;
+	unmounted_ = false;
+	fileNoteBytes_ = fileNoteSize;
+	journalBytes_ = 0;
+	journalTail_ = 0;
+	journalLastRecord_ = 0;
+	if (io_->created())
 	{
 		createService_();
 	}
@@ -305,45 +1884,87 @@ MyFileSystem::MyFileSystem(const char* fileName, const char* fileSize, const cha
 
 MyFileSystem::~MyFileSystem()
 {
-	for (auto it = fileList_.activeMap_.begin(); it != fileList_.activeMap_.end(); ++it)
+	if (unmounted_)
+	{
+		return;
+	}
+	try
+	{
+		unmount();
+	}
+	catch (...) // Исключение не должно покинуть деструктор. Признак корректного отключения не записан, журнал будет воспроизведен при монтировании
+	{
+	}
+}
+
+void MyFileSystem::unmount()
+{
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	if (unmounted_)
 	{
-		beforeClosingFile_(it);
+		return;
 	}
-	overWriteFileService_();
-	delete[] bitMap_;
-	mainFile_.close();
+	unmounted_ = true; // Повторная попытка после ошибки могла бы пометить корректной частично записанную систему
+	if (journalBytes_)
+	{
+		commitJournal_();
+		checkpoint_();
+	}
+	else
+	{
+		flushMetadata_();
+	}
+	writeSuperBlock_(true);
+	io_->sync();
 }
 
 void MyFileSystem::printMainInfo() const
 {
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
 	std::cout << "File system size: " << mainFileSize_ << std::endl;
 	std::cout << "Block size: " << blockSize_ << std::endl;
 	std::cout << "Blocks count: " << blockCount_ << std::endl;
 	std::cout << "Service blocks count: " << blocksForService_ << std::endl;
 	std::cout << "Data blocks count: " << blocksForData_ << std::endl;
-	std::cout << "Files count: " << fileList_.staticMap_.size() << std::endl;
-	std::cout << "Max files count: " << fileList_.maxFileCount_ << std::endl;
-	std::cout << "Open files count: " << fileList_.activeMap_.size() << std::endl << std::endl;;
+	std::cout << "Free blocks count: " << freeBlockCount_ << std::endl;
+	std::cout << "Files count: " << fileList_.size() << std::endl;
+	if (formatVersion_ >= blockDirectoryVersion)
+	{
+		std::cout << "Directory blocks count: " << directoryBlocks_.size() << std::endl;
+	}
+	else
+	{
+		std::cout << "Max files count: " << fileList_.maxFileCount_ << std::endl;
+	}
+	std::cout << "Open files count: " << fileList_.openCount() << std::endl << std::endl;;
 }
 
 void MyFileSystem::printFileInfo() const
 {
-	std::cout << "Total " << fileList_.staticMap_.size() << " files" << std::endl;
-	for (auto it = fileList_.staticMap_.begin(); it != fileList_.staticMap_.end(); ++it)
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	std::cout << "Total " << fileList_.size() << " files" << std::endl;
+	for (size_t record = 0; record < fileList_.recordCount(); ++record)
 	{
-		std::cout << it->first << " - First block: " << it->second.firstBlock_ << ", Size: " << it->second.byteCount_ << std::endl;
+		if (fileList_.used(record))
+		{
+			std::cout << fileList_.name(record) << " - First block: " << fileList_.note(record).firstBlock_ << ", Size: " << fileList_.note(record).byteCount_ << std::endl;
+		}
 	}
-	std::cout << std::endl << fileList_.activeMap_.size() << " open files" << std::endl;
-	for (auto it = fileList_.activeMap_.begin(); it != fileList_.activeMap_.end(); ++it)
+	std::cout << std::endl << fileList_.openCount() << " open files" << std::endl;
+	for (int fd = 1; fd <= fileList_.descriptorLimit(); ++fd)
 	{
-		std::cout << "FD:" << it->first << " - Filename: " << it->second.fileName_ << ", Size: " << it->second.byteCount_
-			<< ", Read pointer: " << it->second.readPointer_ << ", Block read: " << it->second.curBlockToRead_ << std::endl;
+		if (const FileList::activeFileNote* note = fileList_.descriptor(fd))
+		{
+			std::cout << "FD:" << fd << " - Filename: " << fileList_.name(note->record_) << ", Size: " << note->file_->byteCount_
+				<< ", Read pointer: " << note->readPointer_ << ", Extents: " << note->file_->open_->extents_.size() << std::endl;
+		}
 	}
 	std::cout << std::endl;
 }
 
 void MyFileSystem::printSimpleBitMap() const
 {
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
 	std::cout << "Simple Bitmap:" << std::endl;
 	for (size_t i = 0; i < blocksForData_; ++i)
 	{
@@ -361,6 +1982,7 @@ void MyFileSystem::printSimpleBitMap() const
 
 void MyFileSystem::printAdvancedBitMap() const
 {
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
 	std::cout << "Advanced Bitmap:" << std::endl;
 	for (size_t i = 0; i < blocksForData_; ++i)
 	{
@@ -371,41 +1993,59 @@ void MyFileSystem::printAdvancedBitMap() const
 
 int MyFileSystem::create(const std::string& fileName)
 {
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
 	if (fileName.size() > 32)
 	{
 		return -1;
 	}
-	if (fileList_.staticMap_.find(fileName) != fileList_.staticMap_.end())
+	if (fileList_.find(fileName) != FileList::npos)
 	{
 		return -1;
 	}
-	if (fileList_.staticMap_.size() >= fileList_.maxFileCount_)
+	if (fileList_.size() >= fileList_.maxFileCount_)
 	{
 		return -1;
 	}
-	size_t freeBlockIndex;
-	if (!findFreeBlockIndex_(freeBlockIndex))
+	size_t freeBlockIndex, length;
+	if (!allocateRun_(freeBlockIndex, length, blocksForData_, 1)) // Новые файлы разных потоков начинаются в разных областях
 	{
 		return -1;
 	}
-	rewriteBitNote_(1, freeBlockIndex);
-	FileList::fileNote note = { blocksForService_ + freeBlockIndex, 0, false };
-	fileList_.staticMap_.insert(std::make_pair(fileName, note));
+	// Блок каталога присоединяется только после того, как занят первый блок файла, иначе при нехватке места он остался бы лишним
+	if (formatVersion_ >= blockDirectoryVersion && !fileList_.hasFreeRecord() && fileList_.recordCount() >= directoryCapacity_() && !linkDirectoryBlock_())
+	{
+		releaseRun_(freeBlockIndex, length);
+		return -1; // Каталог заполнен, а блока для его продолжения нет
+	}
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	bitMap_.set(freeBlockIndex, 1);
+	markBitNotesDirty_(freeBlockIndex, 1);
+	FileList::fileNote note = { blocksForService_ + freeBlockIndex, 0, blocksForService_ + freeBlockIndex, 1, nullptr };
+	size_t record = fileList_.insert(fileName, note);
+	logFileNote_(fileName, note);
+	markFileListDirty_(record);
+	endOperation_();
 	return 0;
 }
 
 int MyFileSystem::delete_(const std::string& fileName)
 {
-	auto it = fileList_.staticMap_.find(fileName);
-	if (it == fileList_.staticMap_.end())
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	size_t record = fileList_.find(fileName);
+	if (record == FileList::npos)
 	{
 		return -1;
 	}
-	if (it->second.isOpened_)
+	if (fileList_.note(record).open_)
 	{
 		return -1;
 	}
-	size_t index = it->second.firstBlock_ - blocksForService_;
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	// Запись о файле удаляется раньше освобождения блоков, чтобы зафиксированная посреди удаления транзакция не оставила файл с освобожденными блоками
+	size_t index = fileList_.note(record).firstBlock_ - blocksForService_;
+	fileList_.erase(record);
+	logFileDelete_(fileName);
+	markFileListDirty_(record);
 	size_t tmp;
 	while (bitMap_[index] != 1)
 	{
@@ -414,155 +2054,379 @@ int MyFileSystem::delete_(const std::string& fileName)
 			throw std::exception("Bitmap is corrupted");
 		}
 		tmp = bitMap_[index] - blocksForService_;
+		{
+			std::lock_guard<std::mutex> cacheLock(cacheMutex_);
+			cache_.discard(blocksForService_ + index);
+		}
 		rewriteBitNote_(0, index);
+		commitIfFull_();
 		index = tmp;
 	}
+	{
+		std::lock_guard<std::mutex> cacheLock(cacheMutex_);
+		cache_.discard(blocksForService_ + index);
+	}
 	rewriteBitNote_(0, index);
-	fileList_.staticMap_.erase(it);
+	endOperation_();
 	return 0;
 }
 
 int MyFileSystem::open(const std::string& fileName)
 {
-	std::map<std::string, FileList::fileNote>::iterator it;
-	if ((it = fileList_.staticMap_.find(fileName)) == fileList_.staticMap_.end())
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	size_t record = fileList_.find(fileName);
+	if (record == FileList::npos)
 	{
 		return -1;
 	}
-	if (++fileList_.maxID_ < 0)
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	FileList::fileNote& stat = fileList_.note(record);
+	if (!stat.open_)
 	{
-		throw std::exception("Number of opening operations exceeded. Reboot file system");
+		// Сохраненный последний блок может принадлежать цепочке другого файла, а проверить это можно только проходом по цепочке.
+		// Поэтому при первом открытии цепочка проходится один раз, и заодно строятся отрезки блоков для чтения и записи по смещению
+		std::shared_ptr<FileList::openFile> file(new FileList::openFile);
+		file->openCount_ = 0;
+		stat.lastBlock_ = walkChain_(*file, stat.firstBlock_, stat.fileBlocks_);
+		file->extentsBuilt_ = true;
+		stat.open_ = file;
 	}
-	FileList::activeFileNote note = { fileName, it->second.firstBlock_, it->second.byteCount_, 0, it->second.firstBlock_, getLastBlock_(it->second.firstBlock_) };
-	fileList_.activeMap_.insert(std::make_pair(fileList_.maxID_, note));
-	it->second.isOpened_ = true;
-	return fileList_.maxID_;
+	int fd = fileList_.openDescriptor(record);
+	++stat.open_->openCount_;
+	return fd;
 }
 
 int MyFileSystem::close(int fd)
 {
-	std::map<int, FileList::activeFileNote>::iterator it;
-	if ((it = fileList_.activeMap_.find(fd)) == fileList_.activeMap_.end())
+	std::unique_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
 	{
 		return -1;
 	}
-	beforeClosingFile_(it);
-	fileList_.activeMap_.erase(it);
+	FileList::fileNote& file = *note->file_;
+	fileList_.closeDescriptor(fd);
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	if (!--file.open_->openCount_)
+	{
+		file.open_.reset();
+	}
+	if (journalBytes_)
+	{
+		commitJournal_();
+	}
+	else
+	{
+		flushMetadata_();
+	}
+	return 0;
 }
 
 int MyFileSystem::write(int fd, const char* buffer, size_t size)
 {
-	std::map<int, FileList::activeFileNote>::iterator it;
-	if ((it = fileList_.activeMap_.find(fd)) == fileList_.activeMap_.end())
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
 	{
 		return -1;
 	}
-	size_t writeToCurBlock = ((it->second.byteCount_ % blockSize_) || !it->second.byteCount_) ? (blockSize_ - (it->second.byteCount_ % blockSize_)) : 0;
-	size_t curBlock = it->second.lastBlock_;
-	if (writeToCurBlock)
+	std::unique_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	BufferSpan span = { const_cast<char*>(buffer), size };
+	return appendData_(*note, &span, 1, false);
+}
+
+int MyFileSystem::writev(int fd, const BufferSpan* spans, size_t count)
+{
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
 	{
-		mainFile_.seekp(curBlock * blockSize_ + (it->second.byteCount_ % blockSize_), std::ios::beg);
-		mainFile_.clear();
-		if (size <= writeToCurBlock)
-		{
-			mainFile_.write(buffer, size);
-			it->second.byteCount_ += size;
-			return 0;
-		}
-		mainFile_.write(buffer, writeToCurBlock);
+		return -1;
+	}
+	std::unique_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	return appendData_(*note, spans, count, false);
+}
+
+int MyFileSystem::read(int fd, char* buffer, size_t size)
+{
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
+	{
+		return -1;
 	}
-	int bytesWritten = writeToCurBlock;
-	size_t curBlockIndex, prevBlockIndex = curBlock - blocksForService_;
-	if (!findFreeBlockIndex_(curBlockIndex))
+	std::lock_guard<std::mutex> pointerLock(note->pointerMutex_);
+	std::shared_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	FileList::fileNote& file = *note->file_;
+	if (note->readPointer_ >= file.byteCount_)
 	{
-		it->second.byteCount_ += bytesWritten;
-		return bytesWritten;
+		return -1;
 	}
-	rewriteBitNote_(blocksForService_ + curBlockIndex, prevBlockIndex);
-	rewriteBitNote_(1, curBlockIndex);
-	prevBlockIndex = curBlockIndex;
-	int toWrite = (size - bytesWritten) < blockSize_ ? (size - bytesWritten) : blockSize_;
-	writeToBlockIndex_(curBlockIndex, buffer + bytesWritten, toWrite);
-	bytesWritten += toWrite;
-	while (bytesWritten < size)
+	size_t toRead = size < file.byteCount_ - note->readPointer_ ? size : file.byteCount_ - note->readPointer_;
+	if (toRead)
+	{
+		readAhead_(readRange_(file, note->readPointer_, buffer, toRead));
+		note->readPointer_ += toRead;
+	}
+	return toRead < size ? int(toRead) : 0;
+}
+
+int MyFileSystem::readv(int fd, const BufferSpan* spans, size_t count)
+{
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
+	{
+		return -1;
+	}
+	std::lock_guard<std::mutex> pointerLock(note->pointerMutex_);
+	std::shared_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	FileList::fileNote& file = *note->file_;
+	if (note->readPointer_ >= file.byteCount_)
+	{
+		return -1;
+	}
+	size_t size = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		size += spans[i].size_;
+	}
+	size_t toRead = size < file.byteCount_ - note->readPointer_ ? size : file.byteCount_ - note->readPointer_;
+	size_t lastBlock = 0;
+	for (size_t i = 0, done = 0; done < toRead; ++i)
 	{
-		if (!findFreeBlockIndex_(curBlockIndex, prevBlockIndex))
+		size_t chunk = spans[i].size_ < toRead - done ? spans[i].size_ : toRead - done;
+		if (chunk)
 		{
-			it->second.byteCount_ += bytesWritten;
-			return bytesWritten;
+			lastBlock = readRange_(file, note->readPointer_ + done, spans[i].data_, chunk);
+			done += chunk;
 		}
-		rewriteBitNote_(blocksForService_ + curBlockIndex, prevBlockIndex);
-		rewriteBitNote_(1, curBlockIndex);
-		prevBlockIndex = curBlockIndex;
-		toWrite = (size - bytesWritten) < blockSize_ ? (size - bytesWritten) : blockSize_;
-		writeToBlockIndex_(curBlockIndex, buffer + bytesWritten, toWrite);
-		bytesWritten += toWrite;
 	}
-	it->second.byteCount_ += bytesWritten;
-	it->second.lastBlock_ = blocksForService_ + curBlockIndex;
+	if (toRead)
+	{
+		readAhead_(lastBlock);
+		note->readPointer_ += toRead;
+	}
+	return toRead < size ? int(toRead) : 0;
+}
+
+int MyFileSystem::readView(int fd, size_t size, std::vector<DataView>& views)
+{
+	views.clear();
+	const char* mapping = io_->data();
+	if (!mapping)
+	{
+		return -1;
+	}
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
+	{
+		return -1;
+	}
+	std::lock_guard<std::mutex> pointerLock(note->pointerMutex_);
+	std::shared_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	FileList::fileNote& file = *note->file_;
+	if (note->readPointer_ >= file.byteCount_)
+	{
+		return -1;
+	}
+	size_t toRead = size < file.byteCount_ - note->readPointer_ ? size : file.byteCount_ - note->readPointer_;
+	// Отображение должно содержать отложенные асинхронные записи и измененные блоки кэша
+	completeAsync();
+	{
+		std::lock_guard<std::mutex> cacheLock(cacheMutex_);
+		cache_.flush();
+	}
+	for (size_t done = 0, chunk; done < toRead; done += chunk)
+	{
+		size_t pos = locateInFile_(file, note->readPointer_ + done, chunk);
+		chunk = chunk < toRead - done ? chunk : toRead - done;
+		DataView view = { mapping + pos, chunk };
+		views.push_back(view);
+	}
+	note->readPointer_ += toRead;
+	return toRead < size ? int(toRead) : 0;
+}
+
+int MyFileSystem::seek(int fd, size_t offset)
+{
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
+	{
+		return -1;
+	}
+	std::lock_guard<std::mutex> pointerLock(note->pointerMutex_);
+	std::shared_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	if (offset > note->file_->byteCount_)
+	{
+		return -1;
+	}
+	note->readPointer_ = offset;
 	return 0;
 }
 
-int MyFileSystem::read(int fd, char* buffer, size_t size)
+int MyFileSystem::pread(int fd, char* buffer, size_t size, size_t offset)
 {
-	std::map<int, FileList::activeFileNote>::iterator it;
-	if ((it = fileList_.activeMap_.find(fd)) == fileList_.activeMap_.end())
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
 	{
 		return -1;
 	}
-	if (it->second.readPointer_ == it->second.byteCount_)
+	std::shared_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	FileList::fileNote& file = *note->file_;
+	if (offset >= file.byteCount_)
 	{
 		return -1;
 	}
-	size_t readFromCurBlock;
-	std::cout << it->second.curBlockToRead_ << ' ' << it->second.lastBlock_ << std::endl;
-	if (it->second.curBlockToRead_ == it->second.lastBlock_)
+	size_t toRead = size < file.byteCount_ - offset ? size : file.byteCount_ - offset;
+	readRange_(file, offset, buffer, toRead);
+	return toRead < size ? int(toRead) : 0;
+}
+
+int MyFileSystem::pwrite(int fd, const char* buffer, size_t size, size_t offset)
+{
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
 	{
-		readFromCurBlock = ((it->second.byteCount_ % blockSize_) ? it->second.byteCount_ % blockSize_ : blockSize_) - (it->second.readPointer_ % blockSize_);
+		return -1;
 	}
-	else
+	std::unique_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	FileList::fileNote& file = *note->file_;
+	if (offset > file.byteCount_)
 	{
-		readFromCurBlock = blockSize_ - (it->second.readPointer_ % blockSize_);
+		return -1;
 	}
-	mainFile_.seekg(it->second.curBlockToRead_ * blockSize_ + (it->second.readPointer_ % blockSize_), std::ios::beg);
-	mainFile_.clear();
-	if (size <= readFromCurBlock)
+	size_t inPlace = size < file.byteCount_ - offset ? size : file.byteCount_ - offset;
+	writeRange_(file, offset, buffer, inPlace);
+	if (inPlace == size)
+	{
+		return 0;
+	}
+	BufferSpan span = { const_cast<char*>(buffer) + inPlace, size - inPlace };
+	int appended = appendData_(*note, &span, 1, false);
+	return appended > 0 ? int(inPlace + appended) : appended;
+}
+
+int MyFileSystem::readAsync(int fd, char* buffer, size_t size, size_t offset)
+{
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
+	{
+		return -1;
+	}
+	std::shared_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	FileList::fileNote& file = *note->file_;
+	if (offset >= file.byteCount_)
+	{
+		return -1;
+	}
+	size_t toRead = size < file.byteCount_ - offset ? size : file.byteCount_ - offset;
+	queueRange_(file, offset, buffer, toRead, false);
+	return toRead < size ? int(toRead) : 0;
+}
+
+int MyFileSystem::writeAsync(int fd, const char* buffer, size_t size, size_t offset)
+{
+	std::shared_lock<std::shared_mutex> directoryLock(directoryMutex_);
+	FileList::activeFileNote* note = fileList_.descriptor(fd);
+	if (!note)
+	{
+		return -1;
+	}
+	std::unique_lock<std::shared_mutex> fileLock(note->file_->open_->mutex_);
+	FileList::fileNote& file = *note->file_;
+	if (offset > file.byteCount_)
+	{
+		return -1;
+	}
+	size_t inPlace = size < file.byteCount_ - offset ? size : file.byteCount_ - offset;
+	queueRange_(file, offset, const_cast<char*>(buffer), inPlace, true);
+	if (inPlace == size)
 	{
-		mainFile_.read(buffer, size);
-		it->second.readPointer_ += size;
-		if (size == readFromCurBlock)
-		{
-			it->second.curBlockToRead_ = bitMap_[it->second.curBlockToRead_ - blocksForService_];
-		}
 		return 0;
 	}
-	mainFile_.read(buffer, readFromCurBlock);
-	int bytesRead = readFromCurBlock;
-	it->second.readPointer_ += bytesRead;
-	while (bytesRead < size)
+	BufferSpan span = { const_cast<char*>(buffer) + inPlace, size - inPlace };
+	int appended = appendData_(*note, &span, 1, true);
+	return appended > 0 ? int(inPlace + appended) : appended;
+}
+
+void MyFileSystem::completeAsync()
+{
+	std::lock_guard<std::mutex> lock(asyncMutex_);
+	if (asyncRequests_.empty())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> cacheLock(cacheMutex_);
+		cache_.flush(); // Чтения пачки должны увидеть блоки, измененные через кэш
+	}
+	std::vector<IoRequest> requests;
+	requests.swap(asyncRequests_);
+	// Движок не упорядочивает обращения внутри пачки, поэтому обращение, конфликтующее с одним из предыдущих, начинает следующую пачку
+	size_t begin = 0;
+	for (size_t i = 1; i < requests.size(); ++i)
 	{
-		if (!bitMap_[it->second.curBlockToRead_ - blocksForService_])
+		for (size_t j = begin; j < i; ++j)
 		{
-			throw std::exception("Bitmap is corrupted");
+			if (ioConflict(requests[j], requests[i]))
+			{
+				io_->submit(&requests[begin], i - begin);
+				begin = i;
+				break;
+			}
 		}
-		if (bitMap_[it->second.curBlockToRead_ - blocksForService_] == 1)
+	}
+	io_->submit(&requests[begin], requests.size() - begin);
+}
+
+void MyFileSystem::sync()
+{
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	completeAsync();
+	{
+		std::lock_guard<std::mutex> cacheLock(cacheMutex_);
+		cache_.flush();
+	}
+	if (journalBytes_)
+	{
+		if (journalPending_.empty())
 		{
-			return bytesRead;
+			io_->sync();
 		}
-		it->second.curBlockToRead_ = bitMap_[it->second.curBlockToRead_ - blocksForService_];
-		readFromCurBlock = size - bytesRead > blockSize_ ? blockSize_ : size - bytesRead;
-		if (bitMap_[it->second.curBlockToRead_ - blocksForService_] == 1)
+		else
 		{
-			size_t lastBLockSize = (it->second.byteCount_ % blockSize_) ? (it->second.byteCount_ % blockSize_) : blockSize_;
-			readFromCurBlock = readFromCurBlock > lastBLockSize ? lastBLockSize : readFromCurBlock;
+			commitJournal_();
 		}
-		readFromBlock_(it->second.curBlockToRead_, buffer + bytesRead, readFromCurBlock);
-		bytesRead += readFromCurBlock;
-		it->second.readPointer_ += readFromCurBlock;
+		return;
+	}
+	flushMetadata_();
+	writeSuperBlock_(false);
+	io_->sync();
+}
+
+void MyFileSystem::setWriteThrough(bool enabled)
+{
+	std::lock_guard<std::mutex> lock(metadataMutex_);
+	if (enabled && journalBytes_)
+	{
+		commitJournal_();
 	}
-	if (readFromCurBlock == blockSize_ && it->second.curBlockToRead_ != it->second.lastBlock_)
+	else if (enabled)
 	{
-		it->second.curBlockToRead_ = bitMap_[it->second.curBlockToRead_ - blocksForService_];
+		flushMetadata_();
 	}
-	return 0;
+	writeThrough_ = enabled;
+}
+
+void MyFileSystem::setCacheCapacity(size_t blocks)
+{
+	std::lock_guard<std::mutex> lock(cacheMutex_);
+	cache_.flush();
+	cache_.reset(io_.get(), blockSize_, blocks);
 }
\ No newline at end of file
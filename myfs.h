@@ -1,9 +1,17 @@
 ﻿#pragma once
 #include <iostream>
-#include <fstream>
 #include <exception>
 #include <string>
-#include <map>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <cstdint>
+#include "myfsio.h"
 
 // Файловая система делится на блоки, размер которых передается в конструкторе
 // И размер файловой системы, и размер блока являются степенями двойки
@@ -13,15 +21,77 @@
 // Размер массива фиксирован и равняется количеству блоков для данных
 // 0 - блок свободен, 1 - блок является последним для файла, *номер другого блока* - номер следующего блока для файла
 // Однозначность достигается засчет того, что служебная информация всегда занимает минимум два блока
+// Начиная с версии 5 элементы битмапа 4-байтные, если номера блоков помещаются в 32 бита (не больше maxCompactBlockCount блоков). Ширина выбирается при создании системы
+// по количеству блоков, так же хранится битмап в оперативной памяти, поэтому проход по цепочке затрагивает вдвое меньше памяти
+// Служебные блоки систем версии 5 вмещают только битмап, минимальный список файлов, журнал и суперблок, записи о файлах хранятся в каталоге
 // Оставшееся место выделено для сохранения информации о файлах, 8 байтов на количество файлов, далее 48 байтов на один файл
 // 32 байта - имя файла, 8 байтов - номер первого блока файла, 8 байтов - количество байтов в файле
+// Начиная с версии 3 на файл отводится 64 байта: дополнительно 8 байтов - номер последнего блока файла, 8 байтов - количество блоков файла
+// Сохраненный последний блок не принимается на веру: устаревшая запись могла бы указывать на блок другого файла,
+// поэтому при первом открытии файла поля заново вычисляются проходом по цепочке, который заодно строит отрезки блоков файла
+// Начиная с версии 4 записи о файлах по 64 байта хранятся не в служебных блоках, а в каталоге - цепочке блоков данных, которая не принадлежит ни одному файлу
+// Свободное место каталога - записи с пустым именем. Когда свободных записей не остается, каталог дописывается еще одним блоком, поэтому количество файлов ограничено только местом
+// Системы более ранних версий с суперблоком переводятся в этот формат при подключении: каталог записывается в блоки данных раньше, чем суперблок с новой версией
+// Последние superBlockSize байтов служебных блоков занимает суперблок - сводка о системе из 8-байтных полей:
+// метка superBlockMagic, версия формата, признак корректного отключения, количество свободных блоков, количество файлов (начиная с версии 4 - номер первого блока каталога),
+// индекс блока, с которого начинается поиск места под новый файл,
+// размер журнала метаданных в байтах и номер первой транзакции журнала
+// Перед суперблоком расположен журнал метаданных (в системах версии 1 и в системах без суперблока журнала нет)
+// В системах, созданных до появления суперблока, на его месте нули - суперблок дописывается при первом отключении, если записи о файлах не заходят на его место
 
-// Работа с файлами осуществляется засчет двух контейнеров std::map - одного для всех файлов, другого - только для открытых
-// Первый сопоставляет имени файла информацию о его первом блоке, размеру и статусу (открыт / не открыт)
-// Второй сопоставляет дескриптору открытого файла его имя, номер первого блока, размер, позиция чтения, номер читаемого блока, номер послденего блока файла
+// В оперативной памяти записи о файлах хранятся в массиве в порядке их мест в каталоге, освободившиеся места занимаются повторно
+// Запись по имени находится хэш-индексом с открытой адресацией и линейным пробированием за O(1) независимо от количества файлов
+// Запись о файле содержит первый блок, размер, последний блок и состояние открытого файла, общее для всех его дескрипторов:
+// блокировку данных файла и отрезки подряд идущих блоков файла. Отрезки строятся одним проходом по цепочке при открытии файла и дополняются при записи,
+// после чего блок по смещению находится двоичным поиском по отрезкам, а не проходом по цепочке
+// Дескриптор открытого файла - номер в плотной таблице открытых файлов с записью о файле и позицией чтения. Дескрипторы закрытых файлов выдаются повторно
 
-// При изменении битмапа изменения сразу заносятся в файл, в то время как запись обновленной информации о файлах производится только при вызове деструктора класса
-// Также при вызове деструктора и закрытии файла производится запись обновленной информации из контейнера открытых файлов в контейнер всех файлов
+// Метаданные записываются в файл с отложенной записью: измененные страницы битмапа (по bitMapPageSize байтов) отмечаются в битовой маске
+// и записываются по возрастанию адресов, соседние страницы - одним обращением. Записи о файлах переписываются целиком, если изменились
+// Запись происходит при закрытии файла, при вызове sync, при накоплении maxDirtyBitMapPages измененных страниц
+// или при изменении метаданных спустя metadataFlushIntervalMs миллисекунд после первого незаписанного изменения
+// В режиме сквозной записи (setWriteThrough) каждое изменение битмапа и списка файлов сразу заносится в файл
+
+// В системах с журналом изменения метаданных сначала заносятся в журнал, а на свои места записываются только при контрольной точке
+// Журнал - последовательность транзакций: метка journalMagic, номер транзакции, количество 8-байтных слов записей, записи, контрольная сумма
+// Записи: изменение подряд идущих элементов битмапа с их значениями, обнуление подряд идущих элементов, связывание подряд идущих блоков в цепочку,
+// создание файла или изменение его размера, удаление файла. Первое слово записи - тип в младшем байте и количество элементов битмапа в старших
+// Записи копятся в незафиксированной группе и фиксируются одной транзакцией с одним сбросом файла на устройство: при закрытии файла, sync,
+// накоплении journalGroupSize байтов, по истечении metadataFlushIntervalMs или после каждой операции в режиме сквозной записи
+// Когда в журнале остается место меньше чем на две группы записей, выполняется контрольная точка: метаданные записываются на свои места, журнал начинается заново со следующего номера транзакции
+// При подключении зафиксированные транзакции применяются к прочитанным метаданным, после чего выполняется контрольная точка
+
+// Для поиска свободных блоков в оперативной памяти поддерживается иерархический индекс: нижний уровень содержит по биту на каждый блок данных,
+// бит каждого следующего уровня показывает, есть ли свободные блоки в соответствующем 64-битном слове предыдущего уровня
+// Индекс строится при первом поиске свободного блока и затем обновляется при каждом изменении битмапа, поиск просматривает несколько слов независимо от заполненности системы
+// Блоки данных делятся на области (не больше maxAllocationShards, не меньше minAllocationShardBlocks блоков), у каждой области свой индекс и своя блокировка
+// Запись ищет место в области, следующей за последним блоком файла, новый файл - в домашней области потока, и только при нехватке места - в остальных областях
+
+// При подключении системы служебная информация читается одним обращением, количество свободных блоков и файлов берется из суперблока
+// Если система не была корректно отключена, количество свободных блоков пересчитывается по битмапу
+
+// Запись выделяет блоки непрерывными отрезками: ищется отрезок свободных блоков под весь остаток записи, предпочтительно сразу за последним блоком файла
+// Блоки отрезка связываются в битмапе за один проход, их элементы битмапа и данные записываются в файл одним обращением на отрезок
+
+// Данные файлов читаются и записываются через кэш блоков ограниченной вместимости с вытеснением по алгоритму CLOCK
+// Измененные блоки записываются в файл по возрастанию номеров, соседние - одним обращением: при вытеснении измененного блока,
+// перед фиксацией журнала или записью метаданных и при вызове sync. Обращения больше maxCachedTransferBlocks блоков идут в обход кэша
+// При последовательном чтении в кэш заранее загружаются readAheadBlocks следующих блоков цепочки файла
+// Все обращения к файлу системы проходят через движок ввода-вывода (см. myfsio.h), который выбирается в конструкторе
+// Асинхронные обращения к данным (readAsync, writeAsync) копятся и передаются движку одной пачкой, которую движок Fd на Linux выполняет через io_uring
+// Векторные обращения (readv, writev) разбирают и собирают данные прямо в участках буферов вызывающего, без промежуточного буфера
+// С движком Mmap readView возвращает участки отображения файла, по участку на отрезок подряд идущих блоков, не копируя данные
+// Служебная информация читается и записывается целыми массивами за одно обращение
+
+// Методы системы можно вызывать одновременно из нескольких потоков
+// Обращения по дескрипторам (read, write, readv, writev, readView, seek, pread, pwrite, readAsync, writeAsync) совместно берут блокировку списка файлов,
+// create, delete_, open и close - монопольно. Чтения одного файла выполняются параллельно, записи в файл - монопольно по отношению к его чтениям и записям
+// Блоки под запись занимаются в индексе области, данные записываются в занятые блоки, и только затем под блокировкой метаданных блоки присоединяются к цепочке файла
+// вместе с изменением его размера, поэтому зафиксированная в это время транзакция журнала не ссылается на незаписанные данные
+// Битмап, журнал и список файлов изменяются под блокировкой метаданных, кэш блоков и пачка асинхронных обращений - под своими блокировками
+// Цепочки блоков читаются из битмапа тоже под блокировкой метаданных, даже если файл заблокирован
+// Порядок взятия блокировок: список файлов, указатель чтения дескриптора, файл, отрезки файла, метаданные, пачка асинхронных обращений, кэш. Под блокировкой области другие не берутся
+// Вывод информации (print*) берет блокировку списка файлов монопольно
 
 // Далее под номером блока будем подразумевать его абсолютный номер, а под индексом блока - его номер относительно начала пользовательких данных
 // Таким образом, (индекс блока) = (номер блока) - (кол-во служебных блоков)
@@ -39,7 +109,7 @@ const size_t minFileSystemNBlockDifference = 8;
 const size_t minFileCount = 20;
 
 // Минимальное количество байт, отделяемое для информации о файлах
-const size_t minBytesForFileService = 8 + 48 * minFileCount;
+const size_t minBytesForFileService = 8 + 64 * minFileCount;
 
 // Минимально возможное соотношение общего числа блоков к числу блоков для служебной информации
 const size_t minServiceNAllBlocksDifference = 6;
@@ -53,61 +123,362 @@ const size_t fileNameSize = 32;
 // Количество байтов, отведенное для одной записи о файле
 const size_t fileNoteSize = fileNameSize + 8 * 2;
 
+// Количество байтов, отведенное для одной записи о файле в системах версии 3 и новее
+const size_t extendedFileNoteSize = fileNoteSize + 8 * 2;
+
+// Метка суперблока
+const size_t superBlockMagic = 0x4B4C4253594D; // "MYSBLK"
+
+// Размер суперблока в байтах
+const size_t superBlockSize = 64;
+
+// Версия формата файловой системы
+const size_t fileSystemVersion = 5;
+
+// Версия формата, начиная с которой записи о файлах хранятся в каталоге из блоков данных
+const size_t blockDirectoryVersion = 4;
+
+// Версия формата, начиная с которой элементы битмапа могут быть 4-байтными
+const size_t compactBitMapVersion = 5;
+
+// Наибольшее количество блоков системы, при котором элементы битмапа 4-байтные
+const size_t maxCompactBlockCount = size_t(1) << 32;
+
+// Метка транзакции журнала
+const size_t journalMagic = 0x4C4E524A53594D; // "MYSJRNL"
+
+// Максимальный и минимальный размеры журнала метаданных в байтах. Если места под минимальный журнал нет, система создается без журнала
+const size_t maxJournalSize = 1 << 20;
+const size_t minJournalSize = 4096;
+
+// Максимальный размер группы записей журнала, фиксируемой одной транзакцией
+const size_t journalGroupSize = 64 << 10;
+
+// Размер страницы битмапа в байтах, изменения битмапа отслеживаются постранично
+const size_t bitMapPageSize = 4096;
+
+// Количество измененных страниц битмапа, при накоплении которого они записываются в файл
+const size_t maxDirtyBitMapPages = 256;
+
+// Время в миллисекундах, после которого незаписанные изменения метаданных записываются при следующем изменении
+const long long metadataFlushIntervalMs = 1000;
+
+// Размер кэша блоков данных в байтах по умолчанию
+const size_t defaultCacheSize = 4 << 20;
+
+// Количество блоков цепочки файла, загружаемых в кэш заранее при последовательном чтении
+const size_t readAheadBlocks = 8;
+
+// Наибольшее количество блоков в одном обращении к данным, которое проходит через кэш
+const size_t maxCachedTransferBlocks = 16;
+
+// Количество отрезков свободных блоков, просматриваемых при поиске отрезка под запись. Если ни один не вмещает всю запись, берется наибольший
+const size_t maxFreeRunProbes = 16;
+
+// Наибольшее количество областей блоков данных с раздельным выделением блоков
+const size_t maxAllocationShards = 16;
+
+// Наименьшее количество блоков данных в одной области
+const size_t minAllocationShardBlocks = 4096;
+
+// Участок буфера векторного обращения, аналог iovec
+struct BufferSpan
+{
+	char* data_;
+	size_t size_;
+};
+
+// Участок данных файла только для чтения, возвращаемый readView
+struct DataView
+{
+	const char* data_;
+	size_t size_;
+};
+
 class MyFileSystem
 {
 private:
+	// Типы записей журнала
+	static const size_t journalSetNotes_ = 1;
+	static const size_t journalZeroNotes_ = 2;
+	static const size_t journalChainNotes_ = 3;
+	static const size_t journalFileNote_ = 4;
+	static const size_t journalFileDelete_ = 5;
 	class FileList
 	{
 	public:
+		// Отрезок подряд идущих блоков файла: порядковый номер первого блока отрезка в файле, номер этого блока в системе, количество блоков
+		struct blockExtent
+		{
+			size_t fileBlock_;
+			size_t block_;
+			size_t count_;
+		};
+		// Состояние открытого файла, общее для всех его дескрипторов
+		struct openFile
+		{
+			// Чтения берут блокировку совместно, записи - монопольно
+			std::shared_mutex mutex_;
+			// Отрезки блоков файла по порядку. Строятся при открытии файла вместе с проверкой последнего блока, buildExtents_ достраивает их под extentsMutex_, если они еще не построены
+			std::mutex extentsMutex_;
+			std::atomic<bool> extentsBuilt_;
+			std::vector<blockExtent> extents_;
+			// Количество открытых дескрипторов файла
+			size_t openCount_;
+		};
 		struct fileNote
 		{
 			size_t firstBlock_;
 			size_t byteCount_;
-			bool isOpened_;
+			// Номер последнего блока и количество блоков файла, 0 блоков - неизвестны (система старой версии)
+			size_t lastBlock_;
+			size_t fileBlocks_;
+			// Состояние открытого файла, nullptr - файл не открыт
+			std::shared_ptr<openFile> open_;
 		};
 		struct activeFileNote
 		{
-			std::string fileName_;
-			size_t firstBlock_;
-			size_t byteCount_;
+			// Номер записи о файле
+			size_t record_;
+			// Запись о файле. Размер и последний блок изменяются записью под блокировкой файла и блокировкой метаданных
+			fileNote* file_;
 			size_t readPointer_;
-			size_t curBlockToRead_;
-			size_t lastBlock_;
+			// Чтения через один дескриптор сдвигают указатель чтения по очереди
+			std::mutex pointerMutex_;
 		};
-		std::map<std::string, fileNote> staticMap_;
-		std::map<int, activeFileNote> activeMap_;
+	private:
+		struct directoryEntry
+		{
+			// Пустое имя - место свободно
+			std::string name_;
+			size_t hash_;
+			fileNote note_;
+		};
+		// Записи о файлах по местам в каталоге. Ссылки на записи не меняются при добавлении новых
+		std::deque<directoryEntry> records_;
+		// Свободные места в records_
+		std::vector<size_t> freeRecords_;
+		// Хэш-индекс по имени: номер записи + 1, 0 - пустая ячейка. Размер - степень двойки, заполнен не больше чем наполовину
+		std::vector<size_t> slots_;
+		size_t fileCount_;
+		// Таблица открытых файлов, дескриптор fd соответствует элементу fd - 1
+		std::vector<std::unique_ptr<activeFileNote>> descriptors_;
+		std::vector<int> freeDescriptors_;
+		size_t openCount_;
+		static size_t hash_(const std::string& name); // Хэш имени файла
+		size_t findSlot_(size_t record) const; // Возвращает ячейку индекса, указывающую на запись record
+		void insertSlot_(size_t record); // Добавляет запись record в индекс, при необходимости увеличивая его вдвое
+	public:
+		static const size_t npos = ~size_t(0);
+		// Наибольшее количество файлов, npos - не ограничено
 		size_t maxFileCount_;
-		int maxID_;
+		FileList();
+		size_t size() const; // Количество файлов
+		size_t recordCount() const; // Количество мест в каталоге, включая свободные
+		bool hasFreeRecord() const; // Есть ли свободное место среди recordCount() мест
+		bool used(size_t record) const; // Занято ли место record
+		const std::string& name(size_t record) const;
+		fileNote& note(size_t record);
+		const fileNote& note(size_t record) const;
+		size_t find(const std::string& name) const; // Возвращает номер записи о файле с именем name или npos
+		size_t insert(const std::string& name, const fileNote& note); // Добавляет запись на свободное место, при его отсутствии - в конец, возвращает ее номер
+		size_t append(const std::string& name, const fileNote& note); // Добавляет запись в конец, пустое имя - свободное место. Используется при чтении каталога
+		void erase(size_t record); // Удаляет запись, ее место становится свободным
+		int openDescriptor(size_t record); // Выдает дескриптор открытого файла с записью record
+		activeFileNote* descriptor(int fd); // Возвращает открытый файл по дескриптору или nullptr
+		const activeFileNote* descriptor(int fd) const;
+		void closeDescriptor(int fd);
+		size_t openCount() const; // Количество открытых дескрипторов
+		int descriptorLimit() const; // Дескрипторы открытых файлов не превышают это значение
 	} fileList_;
-	std::fstream mainFile_;
+	class BitMap
+	{
+	private:
+		// Элементы хранятся в одном из массивов: в compactNotes_ по 4 байта или в notes_ по 8 байтов
+		std::vector<std::uint32_t> compactNotes_;
+		std::vector<size_t> notes_;
+		bool compact_;
+	public:
+		void reset(size_t count, bool compact); // Задает количество элементов и их ширину, элементы обнуляются
+		size_t operator[](size_t index) const;
+		void set(size_t index, size_t value);
+	} bitMap_;
+	class FreeBlockIndex
+	{
+	private:
+		// Количество уровней индекса. Слово верхнего уровня покрывает 2^18 блоков
+		static const size_t levelCount_ = 3;
+		// Уровни индекса, levels_[0] - по биту на блок, 1 - блок свободен
+		std::vector<unsigned long long> levels_[levelCount_];
+		bool findInLevel_(size_t level, size_t from, size_t& result) const; // Находит номер первого единичного бита уровня level, не меньший from, возвращает true, если нашел
+	public:
+		void build(const BitMap& bitMap, size_t begin, size_t count); // Строит индекс по count элементам битмапа, начиная с индекса begin
+		void set(size_t index, bool isFree); // Отмечает блок с индексом index свободным или занятым
+		bool find(size_t from, size_t& resultIndex) const; // Находит индекс первого свободного блока, не меньший from, возвращает true, если нашел
+		size_t runLength(size_t index, size_t maxLength) const; // Возвращает количество подряд идущих свободных блоков, начиная с индекса index, но не больше maxLength
+	};
+	// Область блоков данных со своим индексом свободных блоков. Индексы в freeIndex_ отсчитываются от начала области
+	struct alignas(64) AllocationShard
+	{
+		std::mutex mutex_;
+		FreeBlockIndex freeIndex_;
+		// Построен ли индекс. Строится под блокировкой метаданных, чтобы битмап области не менялся во время построения
+		std::atomic<bool> freeIndexBuilt_;
+		// Индекс первого блока области и количество блоков в ней
+		size_t begin_;
+		size_t count_;
+		// Индекс блока, с которого начинается поиск места под новый файл в области
+		size_t cursor_;
+	};
+	class BlockCache
+	{
+	private:
+		struct frame
+		{
+			size_t block_;
+			bool used_;
+			bool referenced_;
+			bool dirty_;
+		};
+		IoEngine* io_;
+		size_t blockSize_;
+		// Содержимое блоков, по blockSize_ байтов на место в кэше
+		std::vector<char> data_;
+		std::vector<frame> frames_;
+		// Номер блока - номер его места в кэше
+		std::unordered_map<size_t, size_t> frameOf_;
+		// Стрелка алгоритма CLOCK
+		size_t hand_;
+	public:
+		void reset(IoEngine* io, size_t blockSize, size_t capacity); // Очищает кэш и задает его вместимость в блоках. Измененные блоки должны быть записаны заранее
+		size_t capacity() const; // Вместимость кэша в блоках, 0 - кэш отключен
+		bool contains(size_t block) const; // Есть ли в кэше блок с номером block
+		char* find(size_t block, bool forWrite); // Возвращает содержимое блока с номером block или nullptr, если его нет в кэше. forWrite - блок будет изменен
+		char* insert(size_t block, bool forWrite); // Отводит место под блок с номером block, вытесняя другой блок, и возвращает его для заполнения
+		void discard(size_t block); // Удаляет блок из кэша без записи
+		void flush(); // Записывает измененные блоки по возрастанию номеров, соседние - одним обращением
+	} cache_;
+	// Движок ввода-вывода, через который проходят все обращения к файлу системы
+	std::unique_ptr<IoEngine> io_;
+	// Блокировка списка файлов и дескрипторов
+	mutable std::shared_mutex directoryMutex_;
+	// Блокировка битмапа, журнала, записей о файлах и признаков отложенной записи
+	std::mutex metadataMutex_;
+	// Блокировка пачки асинхронных обращений, удерживается и на время ее выполнения
+	std::mutex asyncMutex_;
+	std::mutex cacheMutex_;
+	std::vector<std::unique_ptr<AllocationShard>> shards_;
+	// Количество блоков в области, кратно 64, чтобы слова индекса разных областей не пересекались
+	size_t shardBlocks_;
 	size_t mainFileSize_;
 	size_t blockSize_;
 	size_t blockCount_;
 	size_t blocksForService_;
 	size_t blocksForData_;
 	size_t fileServiceBegin_;
-	size_t* bitMap_;
+	size_t superBlockBegin_;
+	// Размер записи о файле: fileNoteSize в системах до версии 3, extendedFileNoteSize начиная с нее
+	size_t fileNoteBytes_;
+	// Есть ли в системе суперблок. В старых системах его нет, если записи о файлах занимают его место
+	bool hasSuperBlock_;
+	std::atomic<size_t> freeBlockCount_;
+	// Индекс блока сразу за последним выделенным отрезком, сохраняется в суперблоке
+	std::atomic<size_t> allocationCursor_;
+	// Битовая маска измененных, но не записанных страниц битмапа
+	std::vector<unsigned long long> dirtyBitMapPages_;
+	size_t dirtyBitMapPageCount_;
+	// Изменился ли список файлов с момента последней записи
+	bool fileListDirty_;
+	// Время первого незаписанного изменения метаданных
+	std::chrono::steady_clock::time_point dirtySince_;
+	// Режим сквозной записи метаданных
+	bool writeThrough_;
+	// Выполнялось ли отключение системы
+	bool unmounted_;
+	// Блоки каталога по порядку (начиная с версии 4) и признаки их изменения
+	std::vector<size_t> directoryBlocks_;
+	std::vector<bool> directoryBlockDirty_;
+	// Версия формата системы
+	size_t formatVersion_;
+	size_t journalBegin_;
+	// Размер журнала в байтах, 0 - журнала нет
+	size_t journalBytes_;
+	// Размер группы записей, при котором она фиксируется
+	size_t journalGroupBytes_;
+	// Смещение следующей транзакции от начала журнала
+	size_t journalTail_;
+	// Номер первой транзакции журнала и номер следующей транзакции
+	size_t journalBaseSequence_;
+	size_t journalSequence_;
+	// Накопленные асинхронные обращения к данным, выполняются одной пачкой
+	std::vector<IoRequest> asyncRequests_;
+	// Незафиксированная группа записей журнала
+	std::vector<size_t> journalPending_;
+	// Начало последней записи группы, к которой можно дописать изменение, или journalPending_.size(), если такой нет
+	size_t journalLastRecord_;
 	static bool isPowerOfTwo_(size_t num); // Является ли число степенью двойки
 	static size_t strToLong_(const char* str); // Перевести строку указанного в задании формата в size_t в байтах
-	size_t readLong_(); // Прочитать 8 байт из файла системы в size_t, начиная с текущей позиции чтения
 	size_t readLong_(size_t pos); // Прочитать 8 байт из файла системы в size_t, начиная с позиции pos
-	void writeLong_(size_t num); // Записать size_t в файл системы, начиная с текущей позиции записи
 	void writeLong_(size_t num, size_t pos); // Записать size_t в файл системы, начиная с позиции pos
-	void rewriteBitNote_(size_t num, size_t index); // Изменяет значение элемента битмапа с индексом index на num одновременно и в оперативной памяти, и в файле
-	void readBitMap_(); // Читает битмап из файла в оперативную память
+	// Далее методы, изменяющие битмап, журнал или список файлов, вызываются под блокировкой метаданных
+	void rewriteBitNote_(size_t num, size_t index); // Изменяет значение элемента битмапа с индексом index на num в оперативной памяти и отмечает его для записи в файл
+	void markBitNotesDirty_(size_t index, size_t count); // Отмечает для записи count элементов битмапа, начиная с индекса index. В режиме сквозной записи сразу записывает их
+	void markBitMapPages_(size_t index, size_t count); // Отмечает страницы битмапа с элементами от index до index + count как измененные
+	void markDirectoryRecord_(size_t record); // Отмечает для записи блок каталога с записью record
+	void markFileListDirty_(size_t record); // Отмечает для записи список файлов с измененной записью record. В режиме сквозной записи без журнала сразу записывает его
+	void beginJournalRecord_(size_t type, size_t count); // Начинает в незафиксированной группе запись журнала типа type
+	void logBitNotes_(size_t index, size_t count); // Заносит в группу записей журнала текущие значения count элементов битмапа, начиная с индекса index
+	void logFileNote_(const std::string& fileName, const FileList::fileNote& note); // Заносит в группу записей журнала создание файла или изменение его размера и последнего блока
+	void logFileDelete_(const std::string& fileName); // Заносит в группу записей журнала удаление файла
+	void commitJournal_(); // Фиксирует группу записей одной транзакцией журнала
+	void commitIfFull_(); // Фиксирует группу записей, если она достигла journalGroupBytes_. Вызывается только там, где метаданные согласованы
+	void endOperation_(); // Вызывается в конце операции, изменяющей метаданные, фиксирует группу записей при необходимости
+	void checkpoint_(); // Записывает метаданные на свои места и начинает журнал заново. Группа записей должна быть зафиксирована
+	bool replayJournal_(); // Применяет зафиксированные транзакции журнала к метаданным в оперативной памяти, возвращает true, если применена хоть одна
+	void applyJournalRecords_(const char* records, size_t count); // Применяет записи транзакции из count 8-байтных слов
+	void updateFileNote_(size_t record); // Заносит в журнал измененные размер и последний блок файла с записью record, отмечает запись измененной
+	void flushIfNeeded_(); // Записывает метаданные, если накопилось слишком много изменений или они слишком долго не записывались
+	void flushMetadata_(); // Записывает в файл измененные страницы битмапа и список файлов, если он изменился
+	void readBitMap_(const char* buffer); // Заполняет битмап в оперативной памяти из прочитанной копии битмапа в файле
+	size_t bitNoteBytes_() const; // Размер элемента битмапа в файле: 4 байта в системах версии 5 и новее, если номера блоков помещаются в 32 бита, иначе 8
+	void writeSuperBlock_(bool clean); // Записывает суперблок, clean - признак корректного отключения
+	void initShards_(); // Делит блоки данных на области после инициализации количества блоков данных
+	void buildFreeIndex_(AllocationShard& shard); // Строит индекс свободных блоков области, если он еще не построен. Берет блокировку метаданных
 	void overwriteBitMap_(); // Полностью переписывает битмап из оперативной памяти в файл
-	void overWriteFileService_(); // Перезаписывает данные о файлах из оперативной памяти в файл
+	void overWriteFileService_(); // Перезаписывает данные о файлах из оперативной памяти в файл. Начиная с версии 4 записывает только измененные блоки каталога
+	void storeFileNote_(char* buffer, size_t record); // Записывает запись о файле с номером record в буфер в формате fileNoteBytes_
+	size_t directoryCapacity_() const; // Количество записей, помещающихся в блоки каталога
+	void findDirectoryBlocks_(size_t firstBlock); // Находит блоки каталога проходом по цепочке, начиная с блока с номером firstBlock
+	void readDirectory_(size_t firstBlock); // Находит блоки каталога и читает из них записи о файлах
+	bool linkDirectoryBlock_(); // Дописывает к каталогу чистый блок, возвращает false, если места нет
+	void migrateDirectory_(); // Переносит записи о файлах системы ранней версии в каталог из блоков данных и переводит систему на текущую версию
 	void initServiceInfo_(); // Инициализирует переменные, относящиеся к служебным данным, после инициализации количество блоков данных
+	void initJournalInfo_(); // Инициализирует переменные, относящиеся к журналу, после инициализации размера журнала
 	void createService_(); // Инициализация служебной информации при создании файловой системы 
 	void readService_(); // Инициализация служебной информации при чтении файловой системы из файла
-	void beforeClosingFile_(const std::map<int, FileList::activeFileNote>::iterator& itAct); // Вызывается перед закрытием файла, переписывает данные открытого файла в контейнер всех файлов
-	size_t getLastBlock_(size_t firstBlock) const; // Возвращает номер последнего блока файла по номеру его первого блока
-	bool findFreeBlockIndex_(size_t& resultIndex, size_t startFrom) const; // Находит индекс первого свободного блока, начиная с блока с индексом startFrom, возвращает true, если нашел
-	bool findFreeBlockIndex_(size_t& resultIndex) const; // Находит индекс первого свободного блока
-	void writeToBlockIndex_(size_t index, const char* buffer, size_t count); // Записать count байтов в блок с индексом index, начиная с его начала
-	void readFromBlock_(size_t block, char* buffer, size_t count); // Прочитать count байтов из блока с номером block, начиная с его начала
+	size_t getLastBlock_(size_t firstBlock, size_t& fileBlocks) const; // Возвращает номер последнего блока файла по номеру его первого блока проходом по цепочке, fileBlocks - количество блоков файла
+	size_t threadShard_() const; // Возвращает номер домашней области текущего потока
+	bool findFreeRun_(AllocationShard& shard, size_t& resultIndex, size_t& resultLength, size_t startFrom, size_t maxLength); // Находит в области отрезок свободных блоков длиной до maxLength, начиная поиск с индекса startFrom, возвращает true, если нашел. Вызывается под блокировкой области
+	bool allocateRun_(size_t& resultIndex, size_t& resultLength, size_t startFrom, size_t maxLength); // Занимает в индексе отрезок свободных блоков длиной до maxLength, начиная поиск с области блока startFrom (за концом битмапа - с домашней области потока), возвращает true, если нашел
+	void releaseRun_(size_t index, size_t count); // Возвращает в индекс count блоков, начиная с index, занятых allocateRun_, но еще не присоединенных к цепочке
+	void linkRun_(size_t prevIndex, size_t index, size_t count); // Связывает в цепочку count занятых в индексе блоков, начиная с индекса index, и присоединяет их к блоку с индексом prevIndex
+	void writeBitNotes_(size_t index, size_t count); // Записывает count элементов битмапа, начиная с индекса index, из оперативной памяти в файл одним обращением
+	void storeData_(size_t pos, const char* buffer, size_t count, bool async); // Записать count байтов данных, начиная с позиции pos, через кэш или отложить запись в пачку асинхронных обращений
+	void storeSpans_(size_t pos, const BufferSpan*& spans, size_t& spanOffset, size_t count, bool async); // Записать count байтов из участков, начиная с байта spanOffset участка spans, и сдвинуть spans и spanOffset за записанное
+	void updateCached_(size_t pos, const char* buffer, size_t count); // Обновляет копии блоков в кэше, пересекающиеся с записываемым участком
+	void readData_(size_t pos, char* buffer, size_t count); // Прочитать count байтов данных, начиная с позиции pos в файле системы, через кэш блоков
+	void writeData_(size_t pos, const char* buffer, size_t count); // Записать count байтов данных, начиная с позиции pos в файле системы, через кэш блоков
+	void readAhead_(size_t block); // Загружает в кэш до readAheadBlocks блоков цепочки, следующих за блоком с номером block
+	void buildExtents_(FileList::fileNote& note); // Строит отрезки блоков открытого файла проходом по цепочке, если они еще не построены
+	size_t walkChain_(FileList::openFile& file, size_t firstBlock, size_t& fileBlocks); // Строит отрезки блоков файла проходом по цепочке от блока firstBlock, возвращает последний блок, fileBlocks - количество блоков. Вызывается под блокировкой метаданных
+	void appendExtent_(FileList::openFile& file, size_t block, size_t count); // Добавляет в конец отрезков файла count подряд идущих блоков, начиная с номера block
+	size_t locateInFile_(FileList::fileNote& note, size_t offset, size_t& contiguousBytes); // Возвращает позицию в файле системы байта открытого файла со смещением offset и количество байтов файла, лежащих за ней подряд
+	size_t readRange_(FileList::fileNote& note, size_t offset, char* buffer, size_t size); // Читает size байтов открытого файла, начиная со смещения offset, одним обращением на отрезок, возвращает номер последнего прочитанного блока
+	void writeRange_(FileList::fileNote& note, size_t offset, const char* buffer, size_t size); // Перезаписывает size байтов открытого файла, начиная со смещения offset, одним обращением на отрезок
+	void queueRange_(FileList::fileNote& note, size_t offset, char* buffer, size_t size, bool write); // Добавляет в пачку асинхронных обращений size байтов открытого файла, начиная со смещения offset, по обращению на отрезок
+	int appendData_(FileList::activeFileNote& note, const BufferSpan* spans, size_t count, bool async); // Дописывает в конец открытого файла count участков подряд. async - запись данных откладывается в пачку асинхронных обращений
 public:
-	MyFileSystem(const char* fileName, const char* fileSize, const char* blockSize);
+	MyFileSystem(const char* fileName, const char* fileSize, const char* blockSize, IoEngineType ioType = IoEngineType::Fd);
 	~MyFileSystem();
 	MyFileSystem(const MyFileSystem&) = delete;
 	MyFileSystem(MyFileSystem&&) = delete;
@@ -123,4 +494,34 @@ public:
 	int close(int fd);
 	int write(int fd, const char* buffer, size_t size);
 	int read(int fd, char* buffer, size_t size);
+	// Векторные запись и чтение count участков подряд с теми же результатами, что у write и read для их суммарного размера
+	int writev(int fd, const BufferSpan* spans, size_t count);
+	int readv(int fd, const BufferSpan* spans, size_t count);
+	// Читает size байтов с указателя чтения без копирования: views заполняется участками отображения файла, по участку на отрезок блоков. Результат тот же, что у read
+	// Доступно только с движком Mmap, с другими возвращает -1. Участки действительны до следующего изменения файла
+	int readView(int fd, size_t size, std::vector<DataView>& views);
+	// Устанавливает указатель чтения на смещение offset, не превышающее размер файла
+	int seek(int fd, size_t offset);
+	// Читает size байтов, начиная со смещения offset, не меняя указатель чтения
+	int pread(int fd, char* buffer, size_t size, size_t offset);
+	// Перезаписывает size байтов, начиная со смещения offset, не превышающего размер файла. Часть, выходящая за конец файла, дописывается в конец
+	int pwrite(int fd, const char* buffer, size_t size, size_t offset);
+	// Асинхронные чтение и запись size байтов, начиная со смещения offset, с теми же результатами, что у pread и pwrite
+	// Метаданные обновляются сразу, а обращения к данным копятся и выполняются одной пачкой при вызове completeAsync,
+	// а также перед фиксацией журнала, записью метаданных и в sync. Буфер должен оставаться доступным до выполнения пачки
+	// Пересекающиеся обращения, из которых хотя бы одно - запись, выполняются в порядке вызовов: пачка делится на части, отправляемые по очереди
+	int readAsync(int fd, char* buffer, size_t size, size_t offset);
+	int writeAsync(int fd, const char* buffer, size_t size, size_t offset);
+	// Выполняет накопленные асинхронные обращения одной пачкой и дожидается их завершения
+	void completeAsync();
+	// Записывает все отложенные изменения метаданных, включая размеры открытых файлов, и сбрасывает файл системы на устройство
+	void sync();
+	// Записывает все отложенные изменения и помечает систему корректно отключенной. После вызова система не должна использоваться
+	// При ошибке бросает исключение, а суперблок остается помеченным некорректным, и при следующем монтировании журнал будет воспроизведен
+	// Деструктор выполняет отключение сам, если unmount не вызывался, и подавляет ошибки
+	void unmount();
+	// Включает или выключает сквозную запись метаданных. При включении отложенные изменения сразу записываются
+	void setWriteThrough(bool enabled);
+	// Задает вместимость кэша блоков данных в блоках, 0 - отключает кэш. Измененные блоки предварительно записываются
+	void setCacheCapacity(size_t blocks);
 };
\ No newline at end of file
@@ -0,0 +1,537 @@
+﻿#include "myfsio.h"
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <vector>
+#endif
+
+#ifdef _WIN32
+// Максимальное количество байтов в одном вызове ReadFile / WriteFile
+static const size_t maxWinIoChunk = 1 << 30;
+
+// Заполняет OVERLAPPED смещением pos
+static OVERLAPPED overlappedAt(size_t pos)
+{
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = DWORD(pos);
+	overlapped.OffsetHigh = DWORD(pos >> 32);
+	return overlapped;
+}
+#endif
+
+#ifdef __linux__
+// Кольца io_uring без liburing: очередь отправки, очередь завершения и массив заявок отображаются в память
+struct FdIoEngine::Uring
+{
+	int fd_;
+	unsigned entries_;
+	void* sqRing_;
+	size_t sqRingSize_;
+	void* cqRing_;
+	size_t cqRingSize_;
+	io_uring_sqe* sqes_;
+	unsigned* sqTail_;
+	unsigned* sqMask_;
+	unsigned* sqArray_;
+	unsigned* cqHead_;
+	unsigned* cqTail_;
+	unsigned* cqMask_;
+	io_uring_cqe* cqes_;
+	explicit Uring(unsigned entries);
+	~Uring();
+	void release(); // Снимает отображения колец и закрывает io_uring
+	Uring(const Uring&) = delete;
+	Uring& operator=(const Uring&) = delete;
+	void push(const IoRequest& request, size_t userData, int file); // Помещает обращение в очередь отправки
+};
+
+FdIoEngine::Uring::Uring(unsigned entries) : sqRing_(MAP_FAILED), cqRing_(MAP_FAILED), sqes_(static_cast<io_uring_sqe*>(MAP_FAILED))
+{
+	io_uring_params params = {};
+	fd_ = int(syscall(__NR_io_uring_setup, entries, &params));
+	if (fd_ < 0)
+	{
+		throw std::exception("Can not set up io_uring");
+	}
+	entries_ = params.sq_entries;
+	sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sqRingSize_ = cqRingSize_ = sqRingSize_ > cqRingSize_ ? sqRingSize_ : cqRingSize_;
+	}
+	sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	cqRing_ = params.features & IORING_FEAT_SINGLE_MMAP ? sqRing_ : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+	sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+	if (sqRing_ == MAP_FAILED || cqRing_ == MAP_FAILED || sqes_ == MAP_FAILED)
+	{
+		release();
+		throw std::exception("Can not set up io_uring");
+	}
+	char* sq = static_cast<char*>(sqRing_);
+	char* cq = static_cast<char*>(cqRing_);
+	sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sqMask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cqMask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+FdIoEngine::Uring::~Uring()
+{
+	release();
+}
+
+void FdIoEngine::Uring::release()
+{
+	if (sqes_ != MAP_FAILED)
+	{
+		munmap(sqes_, entries_ * sizeof(io_uring_sqe));
+	}
+	if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+	{
+		munmap(cqRing_, cqRingSize_);
+	}
+	if (sqRing_ != MAP_FAILED)
+	{
+		munmap(sqRing_, sqRingSize_);
+	}
+	::close(fd_);
+}
+
+void FdIoEngine::Uring::push(const IoRequest& request, size_t userData, int file)
+{
+	unsigned tail = *sqTail_;
+	unsigned index = tail & *sqMask_;
+	io_uring_sqe& sqe = sqes_[index];
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = request.write_ ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe.fd = file;
+	sqe.addr = reinterpret_cast<unsigned long long>(request.buffer_);
+	sqe.len = unsigned(request.count_ < (1u << 30) ? request.count_ : (1u << 30));
+	sqe.off = request.pos_;
+	sqe.user_data = userData;
+	sqArray_[index] = index;
+	__atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE); // Ядро должно увидеть заявку раньше нового хвоста очереди
+}
+#endif
+
+void IoEngine::submit(IoRequest* requests, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (requests[i].write_)
+		{
+			write(requests[i].pos_, requests[i].buffer_, requests[i].count_);
+		}
+		else
+		{
+			read(requests[i].pos_, requests[i].buffer_, requests[i].count_);
+		}
+	}
+}
+
+const char* IoEngine::data() const
+{
+	return nullptr;
+}
+
+bool IoEngine::createIfMissing_(const char* fileName, size_t size)
+{
+	if (std::ifstream(fileName, std::ios::binary))
+	{
+		return false;
+	}
+	std::ofstream outFile(fileName, std::ios::binary);
+	if (!outFile)
+	{
+		throw std::exception("Can not create file for file system");
+	}
+	outFile.seekp(size - 1, std::ios::beg);
+	outFile.write("", 1);
+	return true;
+}
+
+std::unique_ptr<IoEngine> IoEngine::open(IoEngineType type, const char* fileName, size_t size)
+{
+	switch (type)
+	{
+	case IoEngineType::Fd:
+		return std::unique_ptr<IoEngine>(new FdIoEngine(fileName, size));
+	case IoEngineType::Mmap:
+		return std::unique_ptr<IoEngine>(new MmapIoEngine(fileName, size));
+	default:
+		return std::unique_ptr<IoEngine>(new FstreamIoEngine(fileName, size));
+	}
+}
+
+size_t IoEngine::size() const
+{
+	return size_;
+}
+
+bool IoEngine::created() const
+{
+	return created_;
+}
+
+FdIoEngine::FdIoEngine(const char* fileName, size_t size)
+{
+	created_ = createIfMissing_(fileName, size);
+#ifdef _WIN32
+	file_ = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER fileSize;
+	if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &fileSize))
+	{
+		if (file_ != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file_);
+		}
+		throw std::exception("Can not open file for file system");
+	}
+	size_ = size_t(fileSize.QuadPart);
+#else
+	struct stat fileStat;
+	if ((file_ = ::open(fileName, O_RDWR)) < 0 || fstat(file_, &fileStat))
+	{
+		if (file_ >= 0)
+		{
+			::close(file_);
+		}
+		throw std::exception("Can not open file for file system");
+	}
+	size_ = size_t(fileStat.st_size);
+#endif
+#ifdef __linux__
+	uringUnavailable_ = false;
+	uringVerified_ = false;
+#endif
+}
+
+FdIoEngine::~FdIoEngine()
+{
+#ifdef _WIN32
+	CloseHandle(file_);
+#else
+	::close(file_);
+#endif
+}
+
+void FdIoEngine::read(size_t pos, void* buffer, size_t count)
+{
+	char* dst = static_cast<char*>(buffer);
+	while (count)
+	{
+#ifdef _WIN32
+		DWORD done = 0;
+		OVERLAPPED overlapped = overlappedAt(pos);
+		if (!ReadFile(file_, dst, DWORD(count < maxWinIoChunk ? count : maxWinIoChunk), &done, &overlapped) || !done)
+		{
+			throw std::exception("Can not read from file system file");
+		}
+#else
+		ssize_t done = pread(file_, dst, count, off_t(pos));
+		if (done < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (done <= 0)
+		{
+			throw std::exception("Can not read from file system file");
+		}
+#endif
+		dst += done;
+		pos += done;
+		count -= done;
+	}
+}
+
+void FdIoEngine::write(size_t pos, const void* buffer, size_t count)
+{
+	const char* src = static_cast<const char*>(buffer);
+	while (count)
+	{
+#ifdef _WIN32
+		DWORD done = 0;
+		OVERLAPPED overlapped = overlappedAt(pos);
+		if (!WriteFile(file_, src, DWORD(count < maxWinIoChunk ? count : maxWinIoChunk), &done, &overlapped) || !done)
+		{
+			throw std::exception("Can not write to file system file");
+		}
+#else
+		ssize_t done = pwrite(file_, src, count, off_t(pos));
+		if (done < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (done <= 0)
+		{
+			throw std::exception("Can not write to file system file");
+		}
+#endif
+		src += done;
+		pos += done;
+		count -= done;
+	}
+}
+
+void FdIoEngine::sync()
+{
+#ifdef _WIN32
+	if (!FlushFileBuffers(file_))
+#else
+	if (fsync(file_))
+#endif
+	{
+		throw std::exception("Can not sync file system file");
+	}
+}
+
+#ifdef __linux__
+void FdIoEngine::submit(IoRequest* requests, size_t count)
+{
+	std::lock_guard<std::mutex> lock(uringMutex_);
+	if (count > 1 && !uring_ && !uringUnavailable_)
+	{
+		try
+		{
+			uring_.reset(new Uring(uringQueueDepth));
+		}
+		catch (const std::exception&)
+		{
+			uringUnavailable_ = true;
+		}
+	}
+	if (count < 2 || !uring_)
+	{
+		IoEngine::submit(requests, count);
+		return;
+	}
+	Uring& ring = *uring_;
+	std::vector<IoRequest> rest(requests, requests + count); // Непереданный остаток каждого обращения
+	size_t next = 0, inFlight = 0;
+	unsigned toSubmit = 0;
+	const char* error = nullptr; // После первой ошибки новые обращения не отправляются, но отправленные дожидаются завершения
+	bool unsupported = false;
+	while ((next < count && !error) || inFlight)
+	{
+		for (; !error && next < count && inFlight < ring.entries_; ++next, ++inFlight, ++toSubmit)
+		{
+			ring.push(rest[next], next, file_);
+		}
+		long submitted = syscall(__NR_io_uring_enter, ring.fd_, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			uring_.reset(); // Состояние колец неизвестно - io_uring закрывается и больше не используется
+			uringUnavailable_ = true;
+			throw std::exception("Can not submit requests to io_uring");
+		}
+		toSubmit -= submitted > 0 ? unsigned(submitted) : 0;
+		unsigned head = *ring.cqHead_;
+		unsigned tail = __atomic_load_n(ring.cqTail_, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head)
+		{
+			const io_uring_cqe& cqe = ring.cqes_[head & *ring.cqMask_];
+			IoRequest& request = rest[size_t(cqe.user_data)];
+			--inFlight;
+			if (error)
+			{
+				continue;
+			}
+			if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+			{
+				ring.push(request, size_t(cqe.user_data), file_);
+				++inFlight;
+				++toSubmit;
+				continue;
+			}
+			if (cqe.res <= 0)
+			{
+				unsupported = cqe.res == -EINVAL && !uringVerified_;
+				error = request.write_ ? "Can not write to file system file" : "Can not read from file system file";
+				continue;
+			}
+			request.pos_ += size_t(cqe.res);
+			request.buffer_ += cqe.res;
+			request.count_ -= size_t(cqe.res);
+			if (request.count_) // Обращение выполнено не полностью - остаток отправляется заново
+			{
+				ring.push(request, size_t(cqe.user_data), file_);
+				++inFlight;
+				++toSubmit;
+			}
+		}
+		__atomic_store_n(ring.cqHead_, head, __ATOMIC_RELEASE);
+	}
+	if (unsupported) // Ядро не поддерживает чтение и запись через io_uring - пачка повторяется по очереди
+	{
+		uring_.reset();
+		uringUnavailable_ = true;
+		IoEngine::submit(requests, count);
+		return;
+	}
+	if (error)
+	{
+		throw std::exception(error);
+	}
+	uringVerified_ = true;
+}
+#endif
+
+MmapIoEngine::MmapIoEngine(const char* fileName, size_t size)
+{
+	created_ = createIfMissing_(fileName, size);
+#ifdef _WIN32
+	file_ = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER fileSize;
+	if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &fileSize))
+	{
+		if (file_ != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file_);
+		}
+		throw std::exception("Can not open file for file system");
+	}
+	size_ = size_t(fileSize.QuadPart);
+	mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	data_ = mapping_ ? static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0)) : nullptr;
+	if (!data_)
+	{
+		if (mapping_)
+		{
+			CloseHandle(mapping_);
+		}
+		CloseHandle(file_);
+		throw std::exception("Can not map file system file");
+	}
+#else
+	struct stat fileStat;
+	if ((file_ = ::open(fileName, O_RDWR)) < 0 || fstat(file_, &fileStat))
+	{
+		if (file_ >= 0)
+		{
+			::close(file_);
+		}
+		throw std::exception("Can not open file for file system");
+	}
+	size_ = size_t(fileStat.st_size);
+	void* data = size_ ? mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0) : MAP_FAILED;
+	if (data == MAP_FAILED)
+	{
+		::close(file_);
+		throw std::exception("Can not map file system file");
+	}
+	data_ = static_cast<char*>(data);
+#endif
+}
+
+MmapIoEngine::~MmapIoEngine()
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data_);
+	CloseHandle(mapping_);
+	CloseHandle(file_);
+#else
+	munmap(data_, size_);
+	::close(file_);
+#endif
+}
+
+void MmapIoEngine::read(size_t pos, void* buffer, size_t count)
+{
+	if (!count)
+	{
+		return;
+	}
+	if (pos > size_ || count > size_ - pos)
+	{
+		throw std::exception("Can not read from file system file");
+	}
+	std::memcpy(buffer, data_ + pos, count);
+}
+
+void MmapIoEngine::write(size_t pos, const void* buffer, size_t count)
+{
+	if (!count)
+	{
+		return;
+	}
+	if (pos > size_ || count > size_ - pos)
+	{
+		throw std::exception("Can not write to file system file");
+	}
+	std::memcpy(data_ + pos, buffer, count);
+}
+
+void MmapIoEngine::sync()
+{
+#ifdef _WIN32
+	if (!FlushViewOfFile(data_, 0) || !FlushFileBuffers(file_))
+#else
+	if (msync(data_, size_, MS_SYNC))
+#endif
+	{
+		throw std::exception("Can not sync file system file");
+	}
+}
+
+const char* MmapIoEngine::data() const
+{
+	return data_;
+}
+
+FstreamIoEngine::FstreamIoEngine(const char* fileName, size_t size)
+{
+	created_ = createIfMissing_(fileName, size);
+	file_.open(fileName, std::ios::in | std::ios::out | std::ios::binary);
+	if (!file_)
+	{
+		throw std::exception("Can not open file for file system");
+	}
+	file_.seekg(0, std::ios::end);
+	size_ = size_t(file_.tellg());
+}
+
+void FstreamIoEngine::read(size_t pos, void* buffer, size_t count)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	file_.clear();
+	file_.seekg(pos, std::ios::beg);
+	if (!file_.read(static_cast<char*>(buffer), count))
+	{
+		throw std::exception("Can not read from file system file");
+	}
+}
+
+void FstreamIoEngine::write(size_t pos, const void* buffer, size_t count)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	file_.clear();
+	file_.seekp(pos, std::ios::beg);
+	if (!file_.write(static_cast<const char*>(buffer), count))
+	{
+		throw std::exception("Can not write to file system file");
+	}
+}
+
+void FstreamIoEngine::sync()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	file_.clear();
+	if (!file_.flush())
+	{
+		throw std::exception("Can not sync file system file");
+	}
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+﻿#pragma once
+#include <fstream>
+#include <exception>
+#include <memory>
+#include <mutex>
+
+// Движок ввода-вывода файловой системы: чтение и запись произвольного отрезка байтов файла по смещению
+// Каждое обращение передает весь отрезок целиком и не зависит от текущей позиции в файле
+// Реализации:
+// Fd - системные вызовы pread / pwrite по дескриптору файла (ReadFile / WriteFile со смещением на Windows)
+// Mmap - файл целиком отображается в память, обращения сводятся к копированию памяти
+// Fstream - запасной вариант через std::fstream, работает везде, где есть стандартная библиотека
+// Если файла нет, он создается заданного размера. Ошибки ввода-вывода выбрасываются исключениями
+// Пачку обращений можно передать движку целиком (submit): по умолчанию они выполняются по очереди,
+// движок Fd на Linux отправляет их через io_uring одним системным вызовом и выполняет одновременно, до uringQueueDepth обращений в полете
+// Если io_uring недоступен (старое ядро или запрет в песочнице), пачка выполняется по очереди. Ядра 5.1-5.5 создают io_uring, но отвергают
+// чтение и запись с -EINVAL - тогда первая пачка повторяется по очереди, и io_uring больше не используется
+// Все движки допускают одновременные обращения из нескольких потоков: Fd и Mmap не имеют общей позиции в файле,
+// Fstream и кольца io_uring защищены мьютексом
+// Движок Mmap дает прямой доступ к отображению файла (data), через который данные читаются без копирования
+
+// Количество одновременно выполняемых обращений пачки в io_uring
+const unsigned uringQueueDepth = 128;
+
+// Обращение к файлу системы в пачке: чтение или запись count байтов, начиная с позиции pos
+struct IoRequest
+{
+	size_t pos_;
+	char* buffer_;
+	size_t count_;
+	bool write_;
+};
+
+enum class IoEngineType
+{
+	Fd,
+	Mmap,
+	Fstream
+};
+
+class IoEngine
+{
+protected:
+	// Размер файла в байтах
+	size_t size_;
+	// Был ли файл создан при открытии
+	bool created_;
+	// Создает файл размером size байтов, если его нет. Возвращает true, если файл был создан
+	static bool createIfMissing_(const char* fileName, size_t size);
+public:
+	virtual ~IoEngine() {}
+	// Открывает файл fileName движком типа type, при отсутствии файла создает его размером size байтов
+	static std::unique_ptr<IoEngine> open(IoEngineType type, const char* fileName, size_t size);
+	// Прочитать count байтов, начиная с позиции pos
+	virtual void read(size_t pos, void* buffer, size_t count) = 0;
+	// Записать count байтов, начиная с позиции pos
+	virtual void write(size_t pos, const void* buffer, size_t count) = 0;
+	// Сбросить записанные данные на устройство. Если сброс не удался, бросает исключение: данные нельзя считать сохраненными
+	virtual void sync() = 0;
+	// Выполнить пачку из count обращений и дождаться их завершения. Порядок выполнения обращений пачки не гарантируется
+	virtual void submit(IoRequest* requests, size_t count);
+	// Начало отображения файла в память или nullptr, если движок не отображает файл
+	virtual const char* data() const;
+	size_t size() const;
+	bool created() const;
+};
+
+class FdIoEngine : public IoEngine
+{
+private:
+#ifdef _WIN32
+	void* file_;
+#else
+	int file_;
+#endif
+#ifdef __linux__
+	// Кольца io_uring, создаются при первой пачке
+	struct Uring;
+	std::unique_ptr<Uring> uring_;
+	// Не удалось создать io_uring - пачки выполняются по очереди
+	bool uringUnavailable_;
+	// Через io_uring уже выполнена пачка без ошибок, поэтому -EINVAL означает ошибку обращения, а не неподдерживаемую операцию
+	bool uringVerified_;
+	// Кольца принимают одну пачку за раз
+	std::mutex uringMutex_;
+#endif
+public:
+	FdIoEngine(const char* fileName, size_t size);
+	~FdIoEngine();
+	FdIoEngine(const FdIoEngine&) = delete;
+	FdIoEngine& operator=(const FdIoEngine&) = delete;
+	void read(size_t pos, void* buffer, size_t count) override;
+	void write(size_t pos, const void* buffer, size_t count) override;
+	void sync() override;
+#ifdef __linux__
+	void submit(IoRequest* requests, size_t count) override;
+#endif
+};
+
+class MmapIoEngine : public IoEngine
+{
+private:
+#ifdef _WIN32
+	void* file_;
+	void* mapping_;
+#else
+	int file_;
+#endif
+	// Начало отображения файла в память
+	char* data_;
+public:
+	MmapIoEngine(const char* fileName, size_t size);
+	~MmapIoEngine();
+	MmapIoEngine(const MmapIoEngine&) = delete;
+	MmapIoEngine& operator=(const MmapIoEngine&) = delete;
+	void read(size_t pos, void* buffer, size_t count) override;
+	void write(size_t pos, const void* buffer, size_t count) override;
+	void sync() override;
+	const char* data() const override;
+};
+
+class FstreamIoEngine : public IoEngine
+{
+private:
+	std::fstream file_;
+	// Позиция в потоке общая, поэтому обращения выполняются по одному
+	std::mutex mutex_;
+public:
+	FstreamIoEngine(const char* fileName, size_t size);
+	void read(size_t pos, void* buffer, size_t count) override;
+	void write(size_t pos, const void* buffer, size_t count) override;
+	void sync() override;
+};
\ No newline at end of file
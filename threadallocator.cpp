@@ -0,0 +1,224 @@
+﻿#include "threadallocator.h"
+#include <atomic>
+#include <algorithm>
+
+ThreadCachingAllocator::Region::Region(void* mem, size_t totalBytes) : allocator_(mem, totalBytes)
+{
+}
+
+ThreadCachingAllocator::ThreadCachingAllocator(void* mem, size_t totalBytes, size_t regionCount)
+{
+	if (!regionCount)
+	{
+		throw std::exception("Region count must be positive");
+	}
+	memByte_ = static_cast<unsigned char*>(mem);
+	totalBytes_ = totalBytes;
+	regionBytes_ = totalBytes / regionCount / 8 * 8;
+	for (size_t i = 0; i < regionCount; ++i)
+	{
+		size_t bytes = i + 1 < regionCount ? regionBytes_ : totalBytes - regionBytes_ * i;
+		regions_.push_back(std::unique_ptr<Region>(new Region(memByte_ + regionBytes_ * i, bytes)));
+	}
+	slots_.reset(new CacheSlot[cacheSlotCount_]);
+	for (size_t i = 0; i < cacheSlotCount_; ++i)
+	{
+		for (size_t j = 0; j < classCount_; ++j)
+		{
+			slots_[i].counts_[j] = 0;
+		}
+	}
+}
+
+size_t ThreadCachingAllocator::threadSlot_()
+{
+	static std::atomic<size_t> threadCounter(0);
+	thread_local size_t slot = threadCounter++ % cacheSlotCount_;
+	return slot;
+}
+
+size_t ThreadCachingAllocator::regionIndex_(const size_t* block) const
+{
+	size_t index = (reinterpret_cast<const unsigned char*>(block) - memByte_) / regionBytes_;
+	return index < regions_.size() ? index : regions_.size() - 1;
+}
+
+size_t* ThreadCachingAllocator::allocateFromRegions_(size_t numBytes, size_t homeRegion)
+{
+	for (size_t i = 0; i < regions_.size(); ++i)
+	{
+		Region& region = *regions_[(homeRegion + i) % regions_.size()];
+		std::lock_guard<std::mutex> lock(region.mutex_);
+		try
+		{
+			return static_cast<size_t*>(region.allocator_.allocate(numBytes));
+		}
+		catch (const std::bad_alloc&)
+		{
+		}
+	}
+	return nullptr;
+}
+
+void ThreadCachingAllocator::returnToRegions_(size_t** blocks, size_t count)
+{
+	std::sort(blocks, blocks + count); // Участки одной области оказываются рядом
+	size_t i = 0;
+	while (i < count)
+	{
+		size_t regionIndex = regionIndex_(blocks[i]);
+		Region& region = *regions_[regionIndex];
+		std::lock_guard<std::mutex> lock(region.mutex_);
+		for (; i < count && regionIndex_(blocks[i]) == regionIndex; ++i)
+		{
+			region.allocator_.deallocate(blocks[i]);
+		}
+	}
+}
+
+void* ThreadCachingAllocator::allocate(size_t numBytes)
+{
+	if (!numBytes)
+	{
+		throw std::bad_alloc();
+	}
+	size_t slotIndex = threadSlot_();
+	size_t homeRegion = slotIndex % regions_.size();
+	size_t* block;
+	if (numBytes > classGranularity_ * classCount_)
+	{
+		if (numBytes > ~size_t(0) - 8) // Размер вместе с номером класса не помещается в size_t
+		{
+			throw std::bad_alloc();
+		}
+		if (!(block = allocateFromRegions_(numBytes + 8, homeRegion)))
+		{
+			flush();
+			if (!(block = allocateFromRegions_(numBytes + 8, homeRegion)))
+			{
+				throw std::bad_alloc();
+			}
+		}
+		block[0] = largeClass_;
+		return block + 1;
+	}
+	size_t sizeClass = (numBytes - 1) / classGranularity_;
+	size_t blockBytes = (sizeClass + 1) * classGranularity_ + 8;
+	CacheSlot& slot = slots_[slotIndex];
+	{
+		std::lock_guard<std::mutex> lock(slot.mutex_);
+		if (slot.counts_[sizeClass])
+		{
+			block = slot.magazines_[sizeClass][--slot.counts_[sizeClass]];
+			block[0] = sizeClass | usedTag_;
+			return block + 1;
+		}
+	}
+	// Магазин пуст - пополнение пачкой из домашней области за одну блокировку
+	size_t* batch[magazineCapacity_ / 2];
+	size_t batchCount = 0;
+	{
+		Region& region = *regions_[homeRegion];
+		std::lock_guard<std::mutex> lock(region.mutex_);
+		try
+		{
+			for (; batchCount < magazineCapacity_ / 2; ++batchCount)
+			{
+				batch[batchCount] = static_cast<size_t*>(region.allocator_.allocate(blockBytes));
+				batch[batchCount][0] = sizeClass;
+			}
+		}
+		catch (const std::bad_alloc&)
+		{
+		}
+	}
+	if (!batchCount)
+	{
+		if (!(block = allocateFromRegions_(blockBytes, homeRegion)))
+		{
+			flush();
+			if (!(block = allocateFromRegions_(blockBytes, homeRegion)))
+			{
+				throw std::bad_alloc();
+			}
+		}
+		block[0] = sizeClass | usedTag_;
+		return block + 1;
+	}
+	block = batch[--batchCount];
+	block[0] = sizeClass | usedTag_;
+	size_t kept = 0;
+	{
+		std::lock_guard<std::mutex> lock(slot.mutex_);
+		for (; kept < batchCount && slot.counts_[sizeClass] < magazineCapacity_; ++kept)
+		{
+			slot.magazines_[sizeClass][slot.counts_[sizeClass]++] = batch[kept];
+		}
+	}
+	if (kept < batchCount) // Кэш делится с другим потоком, который успел заполнить магазин
+	{
+		returnToRegions_(batch + kept, batchCount - kept);
+	}
+	return block + 1;
+}
+
+void ThreadCachingAllocator::deallocate(void* ptr)
+{
+	unsigned char* bytes = static_cast<unsigned char*>(ptr);
+	if (bytes < memByte_ + 8 || bytes >= memByte_ + totalBytes_ || (bytes - memByte_) % 8)
+	{
+		throw std::exception("Trying to deallocate by wrong pointer");
+	}
+	size_t* block = static_cast<size_t*>(ptr) - 1;
+	size_t sizeClass = block[0];
+	if (sizeClass == largeClass_)
+	{
+		Region& region = *regions_[regionIndex_(block)];
+		std::lock_guard<std::mutex> lock(region.mutex_);
+		region.allocator_.deallocate(block);
+		return;
+	}
+	if ((sizeClass & ~classMask_) != usedTag_ || (sizeClass & classMask_) >= classCount_) // Участок не выдавался или уже освобожден
+	{
+		throw std::exception("Trying to deallocate by wrong pointer");
+	}
+	sizeClass &= classMask_;
+	block[0] = sizeClass;
+	size_t* overflow[magazineCapacity_ / 2];
+	size_t overflowCount = 0;
+	{
+		CacheSlot& slot = slots_[threadSlot_()];
+		std::lock_guard<std::mutex> lock(slot.mutex_);
+		size_t** magazine = slot.magazines_[sizeClass];
+		if (slot.counts_[sizeClass] == magazineCapacity_) // Магазин полон - половина участков, пролежавших в нем дольше всего, возвращается в области
+		{
+			overflowCount = magazineCapacity_ / 2;
+			std::copy(magazine, magazine + overflowCount, overflow);
+			std::copy(magazine + overflowCount, magazine + magazineCapacity_, magazine);
+			slot.counts_[sizeClass] -= overflowCount;
+		}
+		magazine[slot.counts_[sizeClass]++] = block;
+	}
+	if (overflowCount)
+	{
+		returnToRegions_(overflow, overflowCount);
+	}
+}
+
+void ThreadCachingAllocator::flush()
+{
+	std::vector<size_t*> blocks;
+	for (size_t i = 0; i < cacheSlotCount_; ++i)
+	{
+		std::lock_guard<std::mutex> lock(slots_[i].mutex_);
+		for (size_t j = 0; j < classCount_; ++j)
+		{
+			blocks.insert(blocks.end(), slots_[i].magazines_[j], slots_[i].magazines_[j] + slots_[i].counts_[j]);
+			slots_[i].counts_[j] = 0;
+		}
+	}
+	if (!blocks.empty())
+	{
+		returnToRegions_(blocks.data(), blocks.size());
+	}
+}
\ No newline at end of file
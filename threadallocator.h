@@ -0,0 +1,68 @@
+﻿#pragma once
+#include <mutex>
+#include <memory>
+#include <vector>
+#include "allocator.h"
+
+// Потокобезопасный аллокатор поверх нескольких областей Allocator
+// Выданная память делится на regionCount равных областей, у каждой свой Allocator и свой мьютекс
+// Перед областями стоят кэши потоков: для каждого класса размеров в кэше хранится магазин недавно освобожденных участков
+// Поток берет участки из своего магазина, не блокируя области. Пустой магазин пополняется пачкой участков из домашней области потока,
+// переполненный - возвращает половину участков в те области, которым они принадлежат, поэтому участок можно освобождать из любого потока
+// Кэшей фиксированное количество, поток получает кэш по своему порядковому номеру; если потоков больше, чем кэшей, кэш делят несколько потоков
+// Перед пользовательскими данными каждого участка записаны 8 байтов с номером класса размеров, или largeClass_ для участков, не проходящих через кэш
+// У выданного участка к номеру класса добавлена метка usedTag_, которая снимается при освобождении, поэтому повторное освобождение обнаруживается
+
+class ThreadCachingAllocator
+{
+private:
+	// Шаг классов размеров в байтах
+	static const size_t classGranularity_ = 16;
+	// Количество классов размеров. Запросы больше classGranularity_ * classCount_ байтов обслуживаются областями напрямую
+	static const size_t classCount_ = 16;
+	// Вместимость одного магазина
+	static const size_t magazineCapacity_ = 64;
+	// Количество кэшей потоков
+	static const size_t cacheSlotCount_ = 64;
+	// Метка участка, не проходящего через кэш
+	static const size_t largeClass_ = ~size_t(0);
+	// Метка выданного участка в старших битах номера класса и маска номера класса
+	static const size_t usedTag_ = size_t(0xA11C) << 48;
+	static const size_t classMask_ = (size_t(1) << 48) - 1;
+	struct alignas(64) Region
+	{
+		std::mutex mutex_;
+		Allocator allocator_;
+		Region(void* mem, size_t totalBytes);
+	};
+	struct alignas(64) CacheSlot
+	{
+		std::mutex mutex_;
+		size_t counts_[classCount_];
+		size_t* magazines_[classCount_][magazineCapacity_];
+	};
+	// Указатель на выделенную память как массив байтов
+	unsigned char* memByte_;
+	// Размер выданной памяти в байтах
+	size_t totalBytes_;
+	// Размер одной области в байтах, последняя область забирает остаток
+	size_t regionBytes_;
+	std::vector<std::unique_ptr<Region>> regions_;
+	std::unique_ptr<CacheSlot[]> slots_;
+	// Возвращает номер кэша текущего потока
+	static size_t threadSlot_();
+	// Возвращает номер области, которой принадлежит участок
+	size_t regionIndex_(const size_t* block) const;
+	// Выделяет участок из домашней области, при нехватке места - из остальных областей. Возвращает nullptr, если места нет ни в одной
+	size_t* allocateFromRegions_(size_t numBytes, size_t homeRegion);
+	// Возвращает участки в их области, блокируя каждую область один раз
+	void returnToRegions_(size_t** blocks, size_t count);
+public:
+	ThreadCachingAllocator(void* mem, size_t totalBytes, size_t regionCount);
+	ThreadCachingAllocator(const ThreadCachingAllocator&) = delete;
+	ThreadCachingAllocator& operator=(const ThreadCachingAllocator&) = delete;
+	void* allocate(size_t numBytes);
+	void deallocate(void* ptr);
+	// Возвращает все участки из кэшей потоков в области
+	void flush();
+};
\ No newline at end of file